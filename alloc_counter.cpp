@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "alloc_counter.hpp"
+
+#include <gmp.h>
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Note: This is constant-initialized, so allocations made during the dynamic
+// initialization of other translation units are counted too.
+std::atomic<uint64_t> num_allocs(0);
+
+void* counted_malloc(size_t size) {
+  num_allocs.fetch_add(1, std::memory_order_relaxed);
+  return std::malloc(size ? size : 1);
+}
+
+// GMP's limbs (i.e., those of BigNums) are allocated with these (and GMP
+// aborts if they fail). Reallocations are not counted: they only grow the
+// storage of BigNums whose values have outgrown it, which (like the growth of
+// a vector) happens less and less often as the storage is reused.
+void* gmp_malloc(size_t size) {
+  void* ptr = counted_malloc(size);
+  if (!ptr) std::abort();
+  return ptr;
+}
+
+void* gmp_realloc(void* ptr, size_t /*old_size*/, size_t new_size) {
+  ptr = std::realloc(ptr, new_size ? new_size : 1);
+  if (!ptr) std::abort();
+  return ptr;
+}
+
+void gmp_free(void* ptr, size_t /*size*/) { std::free(ptr); }
+
+// Note: BigNums that were allocated before this runs are freed with gmp_free,
+// which is compatible with GMP's default allocator (malloc).
+struct RegisterCounter {
+  RegisterCounter() {
+    g_num_allocs = &num_allocs;
+    mp_set_memory_functions(gmp_malloc, gmp_realloc, gmp_free);
+  }
+} register_counter;
+
+}  // namespace
+
+// Note: The sized (C++14) and aligned (C++17) forms do not exist with
+// -std=c++11, so these are all of the replaceable forms.
+void* operator new(size_t size) {
+  if (void* ptr = counted_malloc(size)) return ptr;
+  throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return counted_malloc(size);
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  std::free(ptr);
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "backward_decider.hpp"
+
+#include "static_analyzer.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+namespace {
+
+// A state and the cells known around the head, which are held as bits of a
+// 128-cell window that is wide enough for the head to move MAX_BACKWARD_DEPTH
+// cells either way from the middle.
+struct PartialConfig {
+  uint32_t state;
+  int head;  // Index of the head's cell within the window.
+  uint64_t known[2];
+  uint64_t symbols[2];
+
+  bool is_known(int cell) const {
+    return (known[cell / 64] >> (cell % 64)) & 1;
+  }
+  int symbol(int cell) const { return (symbols[cell / 64] >> (cell % 64)) & 1; }
+  void set(int cell, int symbol) {
+    uint64_t bit = uint64_t(1) << (cell % 64);
+    known[cell / 64] |= bit;
+    symbols[cell / 64] = symbol ? symbols[cell / 64] | bit
+                                : symbols[cell / 64] & ~bit;
+  }
+  // Returns true if this could be the machine's starting configuration, i.e.,
+  // the state is A and every known cell is blank.
+  bool could_be_start() const {
+    return state == 0 && !symbols[0] && !symbols[1];
+  }
+};
+
+class BackwardSearch {
+ public:
+  BackwardSearch(const RuleTable& rule_table, int max_depth,
+                 uint64_t max_num_nodes)
+      : rule_table_(rule_table),
+        max_depth_(max_depth),
+        max_num_nodes_(max_num_nodes),
+        // Only transitions that the machine can ever take can precede
+        // anything.
+        analysis_(analyze_rule_table(rule_table)),
+        depth_(0),
+        num_nodes_(0) {}
+
+  // Returns true if every branch from every halting transition ends.
+  bool run() {
+    for (uint32_t state = 0; state < STATE_HALT; ++state) {
+      for (int symbol = 0; symbol < 2; ++symbol) {
+        if (!analysis_.can_take(state, symbol) ||
+            rule_table_(symbol, state).state < STATE_HALT) {
+          continue;
+        }
+        PartialConfig config = {state, 64, {0, 0}, {0, 0}};
+        config.set(config.head, symbol);
+        if (!search(config, 0)) return false;
+      }
+    }
+    return true;
+  }
+
+  int depth() const { return depth_; }
+  uint64_t num_nodes() const { return num_nodes_; }
+
+ private:
+  // Returns true if every branch back from config ends.
+  bool search(const PartialConfig& config, int depth) {
+    depth_ = std::max(depth_, depth);
+    if (++num_nodes_ > max_num_nodes_ || depth == max_depth_ ||
+        config.could_be_start()) {
+      return false;
+    }
+    for (uint32_t state = 0; state < STATE_HALT; ++state) {
+      for (int symbol = 0; symbol < 2; ++symbol) {
+        Rule rule = rule_table_(symbol, state);
+        if (!analysis_.can_take(state, symbol) || rule.state != config.state) {
+          continue;
+        }
+        // The head was on the cell it has just moved away from, where it
+        // wrote rule.symbol over symbol.
+        int prev_head = config.head + (rule.move_right ? -1 : 1);
+        if (config.is_known(prev_head) &&
+            config.symbol(prev_head) != (int)rule.symbol) {
+          continue;
+        }
+        PartialConfig prev = config;
+        prev.state = state;
+        prev.head = prev_head;
+        prev.set(prev_head, symbol);
+        if (!search(prev, depth + 1)) return false;
+      }
+    }
+    return true;
+  }
+
+  const RuleTable& rule_table_;
+  const int max_depth_;
+  const uint64_t max_num_nodes_;
+  const StaticAnalysis analysis_;
+  int depth_;
+  uint64_t num_nodes_;
+};
+
+}  // end namespace
+
+BackwardResult decide_backward(const RuleTable& rule_table, int max_depth,
+                               uint64_t max_num_nodes) {
+  assert(0 <= max_depth && max_depth <= MAX_BACKWARD_DEPTH);
+  BackwardSearch search(rule_table, max_depth, max_num_nodes);
+  bool decided = search.run();
+  return BackwardResult{decided ? (uint32_t)STATE_NOHALT : STATE_INCOMPLETE,
+                        search.depth(), search.num_nodes()};
+}
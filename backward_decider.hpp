@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "rule_table.hpp"
+
+#include <cstdint>
+
+enum { MAX_BACKWARD_DEPTH = 63 };
+
+struct BackwardResult {
+  // STATE_NOHALT if no halting transition can ever be reached, otherwise
+  // STATE_INCOMPLETE.
+  uint32_t state;
+  // The greatest no. steps back from a halting transition that the search
+  // reached (or max_depth if it gave up).
+  int depth;
+  uint64_t num_nodes;  // The no. partial configurations visited.
+};
+
+// Decides machines by reasoning backwards from each of their halting
+// transitions, without any forward simulation. The search visits partial
+// configurations (a state and the cells known around the head) that must have
+// preceded the halt, one step further back at a time. A configuration with no
+// possible predecessor ends its branch, and if every branch ends within
+// max_depth steps (and none can be the blank starting configuration), the halt
+// can never be reached.
+//
+// Gives up (returning STATE_INCOMPLETE) if any branch reaches max_depth (which
+// must be at most MAX_BACKWARD_DEPTH) or more than max_num_nodes configurations
+// are visited.
+BackwardResult decide_backward(const RuleTable& rule_table, int max_depth,
+                               uint64_t max_num_nodes = 1 << 20);
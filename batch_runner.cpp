@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "batch_runner.hpp"
+
+#include "rule_table.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+const char* const DEFAULT_BATCH_PIPELINE_STAGES =
+    "static,flat,cycler,translated,backward,far,proof";
+
+namespace {
+
+struct WorkQueue {
+  std::mutex mutex;
+  std::deque<size_t> jobs;
+};
+
+// Takes the next job for the given worker, stealing from another worker's
+// queue if its own is empty. Returns false once all the queues are empty.
+bool take_job(std::vector<WorkQueue>* queues, size_t worker, size_t* job) {
+  {
+    WorkQueue& queue = (*queues)[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.jobs.empty()) {
+      *job = queue.jobs.front();
+      queue.jobs.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues->size(); ++i) {
+    WorkQueue& victim = (*queues)[(worker + i) % queues->size()];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.jobs.empty()) {
+      *job = victim.jobs.back();
+      victim.jobs.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string json_string(const std::string& s) {
+  std::string result = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += c;
+    } else if ((unsigned char)c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      result += escaped;
+    } else {
+      result += c;
+    }
+  }
+  return result + "\"";
+}
+
+std::string trim(const std::string& s) {
+  const char* const whitespace = " \t\r\n";
+  size_t begin = s.find_first_not_of(whitespace);
+  if (begin == std::string::npos) return "";
+  return s.substr(begin, s.find_last_not_of(whitespace) + 1 - begin);
+}
+
+const char* result_name(uint32_t state) {
+  switch (state) {
+    case STATE_HALT:
+      return "halt";
+    case STATE_NOHALT:
+      return "nohalt";
+    default:
+      return "incomplete";
+  }
+}
+
+}  // end namespace
+
+BatchRunner::BatchRunner(const std::string& stages, int macro_nbit,
+                         const TMOptions& options, int num_threads)
+    : stages_(stages),
+      macro_nbit_(macro_nbit),
+      options_(options),
+      num_threads_(num_threads),
+      stats_(stages, macro_nbit, options) {
+  options_.silent = true;
+  if (num_threads_ <= 0) {
+    num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+size_t BatchRunner::run(std::istream& in, std::ostream& out) {
+  std::vector<std::string> machines;
+  std::string line;
+  while (std::getline(in, line)) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') continue;
+    machines.push_back(line);
+  }
+  if (machines.empty()) return 0;
+
+  size_t num_workers = std::min((size_t)num_threads_, machines.size());
+  std::vector<WorkQueue> queues(num_workers);
+  for (size_t i = 0; i < machines.size(); ++i) {
+    queues[i * num_workers / machines.size()].jobs.push_back(i);
+  }
+
+  // Results are buffered until all earlier ones have been written.
+  std::mutex output_mutex;
+  std::vector<std::string> results(machines.size());
+  std::vector<bool> finished(machines.size(), false);
+  size_t num_written = 0;
+
+  auto write_result = [&](size_t index, const std::string& result) {
+    std::lock_guard<std::mutex> lock(output_mutex);
+    results[index] = result;
+    finished[index] = true;
+    while (num_written < machines.size() && finished[num_written]) {
+      out << results[num_written] << std::endl;
+      results[num_written].clear();
+      ++num_written;
+    }
+  };
+
+  std::vector<std::unique_ptr<DeciderPipeline>> pipelines(num_workers);
+  auto work = [&](size_t worker) {
+    DeciderPipeline& pipeline = *pipelines[worker];
+    size_t index;
+    while (take_job(&queues, worker, &index)) {
+      std::stringstream ss;
+      ss << "{\"index\": " << index
+         << ", \"machine\": " << json_string(machines[index]);
+      auto start_time = std::chrono::steady_clock::now();
+      try {
+        std::string stage;
+        TMResult result = pipeline.run(RuleTable(machines[index]), &stage);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start_time;
+        ss << ", \"result\": \"" << result_name(result.state) << "\"";
+        ss << ", \"ones\": ";
+        if (result.state == STATE_HALT) {
+          ss << "\"" << result.num_ones << "\"";
+        } else {
+          ss << "null";
+        }
+        ss << ", \"steps\": \"" << result.num_steps << "\"";
+        ss << ", \"stage\": " << (stage.empty() ? "null" : json_string(stage));
+        ss << ", \"seconds\": " << elapsed.count();
+      } catch (const std::runtime_error& e) {
+        ss << ", \"result\": \"error\", \"error\": " << json_string(e.what());
+      }
+      ss << "}";
+      write_result(index, ss.str());
+    }
+  };
+
+  for (size_t i = 0; i < num_workers; ++i) {
+    pipelines[i].reset(new DeciderPipeline(stages_, macro_nbit_, options_));
+  }
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_workers; ++i) threads.emplace_back(work, i);
+  work(0);
+  for (std::thread& thread : threads) thread.join();
+  for (const auto& pipeline : pipelines) stats_.merge_stats(*pipeline);
+  return machines.size();
+}
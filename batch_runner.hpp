@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "decider_pipeline.hpp"
+#include "turing_machine.hpp"
+
+#include <iostream>
+#include <string>
+
+// The stages that BatchRunner runs by default. Batches are usually machines
+// left over from earlier runs, which are worth running every decider on.
+extern const char* const DEFAULT_BATCH_PIPELINE_STAGES;
+
+// Runs lists of machines through DeciderPipelines on a pool of threads.
+//
+// The machines are read one rule table per line (in the RuleTable string
+// syntax, with blank lines and lines starting with '#' skipped) and split
+// evenly between the threads' work queues up front. Each thread takes machines
+// from the front of its own queue and, once that is empty, steals them from
+// the back of the others', so a few slow machines do not leave the other
+// threads idle. Each thread has its own DeciderPipeline, so the only shared
+// state is the queues and the output.
+//
+// One result is written per machine, in input order, as a line of JSON:
+//   {"index": 0, "machine": "B1R B1L  A1L H1R", "result": "halt",
+//    "ones": "4", "steps": "6", "stage": "flat", "seconds": 1.2e-05}
+// where result is "halt", "nohalt", "incomplete" or "error" (in which case
+// the other fields are replaced by "error": "<message>"), and ones is null
+// unless the machine halted.
+class BatchRunner {
+ public:
+  // The per-machine step, span and wall-time budgets in options apply to the
+  // proof stage, which is the only one without budgets of its own. Throws
+  // std::runtime_error if stages is invalid (see DeciderPipeline). num_threads
+  // = 0 uses one thread per hardware thread.
+  BatchRunner(const std::string& stages, int macro_nbit,
+              const TMOptions& options, int num_threads = 0);
+
+  // Runs all the machines in the input and returns the no. that were run.
+  size_t run(std::istream& in, std::ostream& out);
+
+  // Prints the stats of each pipeline stage summed over all runs.
+  void print_stats(std::ostream& os) const { stats_.print_stats(os); }
+
+ private:
+  const std::string stages_;
+  const int macro_nbit_;
+  TMOptions options_;
+  int num_threads_;
+  DeciderPipeline stats_;
+};
@@ -32,6 +32,7 @@
 
 #include <cmath>
 #include <iostream>
+#include <memory>
 
 // Note that any integer-like class will work here (with the exception of the
 // below utilities that are specific to GMP).
@@ -58,6 +59,72 @@ inline static void summarize_bignum(const BigNum& bn, double* base10_mantissa,
 
 }  // namespace detail
 
+// Adds a * b to *x. Unlike *x += a * b, this does not allocate a temporary for
+// the product.
+inline void add_product(BigNum* x, const BigNum& a, const BigNum& b) {
+  mpz_addmul(x->get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+}
+
+// Storage for a BigNum value that is usually small. Values that fit in a long
+// are stored inline (avoiding BigNum's heap allocation), and larger values fall
+// back to a heap-allocated BigNum. Once allocated, the BigNum is kept and used
+// for all later values (including small ones), so that overwriting a value
+// never allocates again.
+class CompactBigNum {
+ public:
+  CompactBigNum() : small_(0) {}
+  CompactBigNum(const BigNum& value) : small_(0) { *this = value; }
+  CompactBigNum(const CompactBigNum& other)
+      : small_(other.small_),
+        big_(other.big_ ? new BigNum(*other.big_) : nullptr) {}
+  CompactBigNum(CompactBigNum&& other) = default;
+  CompactBigNum& operator=(const CompactBigNum& other) {
+    if (other.big_) {
+      *this = *other.big_;
+    } else if (big_) {
+      *big_ = other.small_;
+    } else {
+      small_ = other.small_;
+    }
+    return *this;
+  }
+  CompactBigNum& operator=(CompactBigNum&& other) = default;
+  CompactBigNum& operator=(const BigNum& value) {
+    if (big_) {
+      *big_ = value;
+    } else if (mpz_fits_slong_p(value.get_mpz_t())) {
+      small_ = mpz_get_si(value.get_mpz_t());
+    } else {
+      big_.reset(new BigNum(value));
+    }
+    return *this;
+  }
+
+  bool is_small() const { return !big_; }
+  // Writes the value to *value (reusing its storage).
+  void get(BigNum* value) const {
+    if (big_) {
+      *value = *big_;
+    } else {
+      *value = small_;
+    }
+  }
+  BigNum get() const { return big_ ? *big_ : BigNum(small_); }
+
+  bool operator==(const CompactBigNum& other) const {
+    if (!big_ && !other.big_) return small_ == other.small_;
+    if (big_ && other.big_) return *big_ == *other.big_;
+    return big_ ? *big_ == other.small_ : small_ == *other.big_;
+  }
+  bool operator!=(const CompactBigNum& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  long small_;
+  std::unique_ptr<BigNum> big_;
+};
+
 // Utility wrapper to print large BigNum values in scientific notation.
 class ConcisePrintBigNum {
  public:
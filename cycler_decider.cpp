@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "cycler_decider.hpp"
+
+#include <algorithm>
+
+namespace {
+
+// Returns true if the first num_bits bits of a and b are the same.
+template <class Window>
+bool windows_match(const Window& a, const Window& b, int num_bits) {
+  int num_whole_words = num_bits / 64;
+  for (int i = 0; i < num_whole_words; ++i) {
+    if (a[i] != b[i]) return false;
+  }
+  int num_remaining_bits = num_bits % 64;
+  if (!num_remaining_bits) return true;
+  uint64_t mask = (uint64_t(1) << num_remaining_bits) - 1;
+  return ((a[num_whole_words] ^ b[num_whole_words]) & mask) == 0;
+}
+
+}  // end namespace
+
+CyclerResult decide_cycler(const RuleTable& rule_table, uint64_t max_num_steps,
+                           size_t max_tape_size) {
+  FlatMachine machine(rule_table, /*track_hash=*/true);
+  FlatMachine checkpoint = machine;
+  uint64_t checkpoint_hash = checkpoint.configuration_hash();
+  uint64_t power = 1;
+  uint64_t num_steps_since_checkpoint = 0;
+  while (machine.num_steps() < max_num_steps &&
+         machine.tape_size() <= max_tape_size) {
+    if (machine.run(1)) {
+      return CyclerResult{machine.state(), machine.num_steps(),
+                          machine.num_ones(), 0, 0};
+    }
+    ++num_steps_since_checkpoint;
+    if (machine.configuration_hash() == checkpoint_hash &&
+        machine.same_configuration(checkpoint)) {
+      return CyclerResult{STATE_NOHALT, machine.num_steps(), machine.num_ones(),
+                          num_steps_since_checkpoint, 0};
+    }
+    if (num_steps_since_checkpoint == power) {
+      checkpoint = machine;
+      checkpoint_hash = checkpoint.configuration_hash();
+      power *= 2;
+      num_steps_since_checkpoint = 0;
+    }
+  }
+  return CyclerResult{STATE_INCOMPLETE, machine.num_steps(), machine.num_ones(),
+                      0, 0};
+}
+
+TranslatedCyclerDetector::TranslatedCyclerDetector(int cell_nbit)
+    : cell_nbit_(cell_nbit),
+      max_window_size_(MAX_WINDOW_NBIT / cell_nbit),
+      cycle_length_(0),
+      shift_(0) {
+  for (int i = 0; i < 2; ++i) {
+    sides_[i].direction = i ? +1 : -1;
+    sides_[i].record_position = 0;
+    sides_[i].furthest_back_since_record = 0;
+  }
+}
+
+template <typename ReadWindow>
+bool TranslatedCyclerDetector::update(uint32_t state, uint64_t num_steps,
+                                      int64_t position,
+                                      const bool at_record[2],
+                                      const ReadWindow& read_window) {
+  for (int i = 0; i < 2; ++i) {
+    Side& side = sides_[i];
+    if (at_record[i]) {
+      side.record_position = side.direction * position;
+      read_window(side);
+      if (add_record(state, num_steps, &side)) return true;
+    } else {
+      side.furthest_back_since_record = std::min(
+          side.furthest_back_since_record, side.direction * position);
+    }
+  }
+  return false;
+}
+
+bool TranslatedCyclerDetector::add_record(uint32_t state, uint64_t num_steps,
+                                          Side* side) {
+  int64_t position = side->record_position;
+  if (!side->records.empty()) {
+    side->records.back().furthest_back = side->furthest_back_since_record;
+  }
+  int64_t furthest_back = position;
+  for (int age = 0; age < side->records.size(); ++age) {
+    const Record& record = side->records.from_back(age);
+    furthest_back = std::min(furthest_back, record.furthest_back);
+    int64_t num_cells = record.position - furthest_back + 1;
+    if (record.state == state && num_cells <= max_window_size_ &&
+        windows_match(record.window, window_, num_cells * cell_nbit_)) {
+      cycle_length_ = num_steps - record.num_steps;
+      shift_ = side->direction * (position - record.position);
+      return true;
+    }
+  }
+  Record& record = side->records.push_back_recycled();
+  record.state = state;
+  record.num_steps = num_steps;
+  record.position = position;
+  record.furthest_back = position;
+  record.window = window_;
+  side->furthest_back_since_record = position;
+  return false;
+}
+
+bool TranslatedCyclerDetector::update(const FlatMachine& machine) {
+  int64_t position = machine.head_position();
+  bool at_record[2];
+  for (int i = 0; i < 2; ++i) {
+    at_record[i] = sides_[i].direction * position > sides_[i].record_position;
+  }
+  return update(machine.state(), machine.num_steps(), position, at_record,
+                [&](const Side& side) {
+                  window_.fill(0);
+                  for (int i = 0; i < MAX_WINDOW_NBIT; ++i) {
+                    int64_t cell = position - side.direction * i;
+                    window_[i / 64] |= uint64_t(machine.symbol_at(cell))
+                                       << (i % 64);
+                  }
+                });
+}
+
+bool TranslatedCyclerDetector::update(const MacroMachineState& mstate,
+                                      int64_t macro_pos, uint64_t num_steps) {
+  // The head is only beyond every cell it has visited when it is on the blank
+  // span at that end of the tape, moving outwards.
+  bool at_record[2] = {
+      mstate.cur_span == mstate.tape.begin() && !mstate.moving_right,
+      std::next(mstate.cur_span) == mstate.tape.end() && mstate.moving_right};
+  return update(
+      mstate.state * 2 + mstate.moving_right, num_steps, macro_pos, at_record,
+      [&](const Side& side) {
+        window_.fill(0);
+        // The head's own cell (on the blank span) is cell 0.
+        int cell = 1;
+        auto add_span = [&](const TapeSpan& span) {
+          for (unsigned long i = 0; span.size > i && cell < max_window_size_;
+               ++i, ++cell) {
+            for (int bit = 0; bit < cell_nbit_; ++bit) {
+              int window_bit = cell * cell_nbit_ + bit;
+              window_[window_bit / 64] |= uint64_t((span.symbol >> bit) & 1)
+                                          << (window_bit % 64);
+            }
+          }
+        };
+        if (side.direction > 0) {
+          for (auto span = mstate.cur_span;
+               span != mstate.tape.begin() && cell < max_window_size_;) {
+            add_span(*--span);
+          }
+        } else {
+          for (auto span = std::next(mstate.cur_span);
+               span != mstate.tape.end() && cell < max_window_size_; ++span) {
+            add_span(*span);
+          }
+        }
+      });
+}
+
+void TranslatedCyclerDetector::reset() {
+  for (Side& side : sides_) side.records.clear();
+}
+
+CyclerResult decide_translated_cycler(const RuleTable& rule_table,
+                                      uint64_t max_num_steps) {
+  FlatMachine machine(rule_table);
+  TranslatedCyclerDetector detector;
+  while (machine.num_steps() < max_num_steps) {
+    if (machine.run(1)) {
+      return CyclerResult{machine.state(), machine.num_steps(),
+                          machine.num_ones(), 0, 0};
+    }
+    if (detector.update(machine)) {
+      return CyclerResult{STATE_NOHALT, machine.num_steps(), machine.num_ones(),
+                          detector.cycle_length(), detector.shift()};
+    }
+  }
+  return CyclerResult{STATE_INCOMPLETE, machine.num_steps(), machine.num_ones(),
+                      0, 0};
+}
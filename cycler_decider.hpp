@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "flat_machine.hpp"
+#include "macro_machine.hpp"
+#include "ring_buffer.hpp"
+#include "rule_table.hpp"
+
+#include <array>
+#include <cstdint>
+
+struct CyclerResult {
+  // STATE_HALT or STATE_NOHALT if the machine was decided, otherwise
+  // STATE_INCOMPLETE.
+  uint32_t state;
+  uint64_t num_steps;  // The no. steps simulated.
+  uint64_t num_ones;   // The no. ones on the tape at the end.
+  // If state == STATE_NOHALT, the no. steps after which the configuration
+  // repeats.
+  uint64_t cycle_length;
+  // If state == STATE_NOHALT, the no. cells that the configuration moves by
+  // each cycle (which is 0 for decide_cycler).
+  int64_t shift;
+};
+
+// Decides machines that return to exactly the same configuration (state, head
+// position and tape contents), and therefore loop forever, by simulating them
+// on a FlatMachine. The configuration is compared against a single checkpoint
+// that is moved forward whenever the no. steps since it reaches the next power
+// of two (Brent's algorithm), so memory use stays constant and a cycle of
+// length L starting at step S is found within about S + 2 * L steps. Each
+// comparison is a comparison of incrementally-maintained hashes, with the full
+// tape only compared on a hash match.
+//
+// Gives up (returning STATE_INCOMPLETE) after max_num_steps steps or once the
+// tape has grown beyond max_tape_size cells, which a machine whose head drifts
+// off forever will eventually do.
+CyclerResult decide_cycler(const RuleTable& rule_table, uint64_t max_num_steps,
+                           size_t max_tape_size = 1 << 16);
+
+// Watches a machine for translated cycles, i.e., for a pattern that repeats
+// while moving steadily in one direction (leaving junk behind it), which is how
+// many machines that run off along the tape forever behave.
+//
+// Each time the head reaches a new record position (furthest right or furthest
+// left), the state and the cells behind the head are recorded. If an earlier
+// record on the same side had the same state, and the head has not since gone
+// back more than K cells behind that earlier record, then everything from the
+// earlier record to now depended only on those K + 1 cells (and the blank
+// cells ahead). So if the K + 1 cells behind the head now are the same as they
+// were then, the machine repeats the same steps, shifted along, forever.
+//
+// The machine may be a FlatMachine, or a MacroMachine (whose cells are macro
+// symbols and whose states include the direction the head is moving in).
+class TranslatedCyclerDetector {
+ public:
+  // The no. bits behind the head that are recorded at each record (which
+  // bounds the no. cells the head can go back within a cycle).
+  static constexpr int MAX_WINDOW_NBIT = 256;
+  // The no. recent records that are kept on each side.
+  static constexpr int NUM_RECORDS = 256;
+
+  // cell_nbit is the no. bits per cell (i.e., macro_nbit for a MacroMachine).
+  explicit TranslatedCyclerDetector(int cell_nbit = 1);
+
+  // Must be called after every step of the machine (from its start). Returns
+  // true if the machine has been found to be a translated cycler, after which
+  // cycle_length() and shift() describe the cycle.
+  bool update(const FlatMachine& machine);
+  // The same for a MacroMachine, with the head at macro_pos after num_steps
+  // macro steps. Steps that skip over others (e.g., pattern applications) must
+  // instead be followed by a call to reset().
+  bool update(const MacroMachineState& mstate, int64_t macro_pos,
+              uint64_t num_steps);
+  // Forgets the records, after which the machine is watched as if it started
+  // from its current configuration.
+  void reset();
+
+  uint64_t cycle_length() const { return cycle_length_; }
+  int64_t shift() const { return shift_; }
+
+ private:
+  typedef std::array<uint64_t, MAX_WINDOW_NBIT / 64> Window;
+
+  struct Record {
+    uint32_t state;
+    uint64_t num_steps;
+    // The head's position, measured in the direction of the side's records.
+    int64_t position;
+    // The furthest-back position (in the same measure) of the head between
+    // this record and the next one.
+    int64_t furthest_back;
+    // Bits [i * cell_nbit, (i + 1) * cell_nbit) hold the cell i cells behind
+    // the head.
+    Window window;
+  };
+
+  struct Side {
+    int direction;  // +1 for the right side, -1 for the left.
+    RingBuffer<Record, NUM_RECORDS> records;
+    int64_t record_position;
+    int64_t furthest_back_since_record;
+  };
+
+  // Updates each side with the head at position, where at_record[i] says
+  // whether it is at a new record on side i, in which case read_window is
+  // called with the side to fill window_.
+  template <typename ReadWindow>
+  bool update(uint32_t state, uint64_t num_steps, int64_t position,
+              const bool at_record[2], const ReadWindow& read_window);
+  // Records a new record on the given side (whose cells behind the head are in
+  // window_), and returns true if it repeats an earlier one.
+  bool add_record(uint32_t state, uint64_t num_steps, Side* side);
+
+  const int cell_nbit_;
+  const int max_window_size_;  // The no. cells that fit in a Window.
+  Side sides_[2];
+  Window window_;  // Scratch space.
+  uint64_t cycle_length_;
+  int64_t shift_;
+};
+
+// Decides machines that are translated cyclers (see TranslatedCyclerDetector)
+// by simulating them on a FlatMachine for up to max_num_steps steps. This is a
+// fast screen for machines that drift off forever.
+CyclerResult decide_translated_cycler(const RuleTable& rule_table,
+                                      uint64_t max_num_steps);
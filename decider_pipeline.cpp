@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "decider_pipeline.hpp"
+
+#include "backward_decider.hpp"
+#include "cycler_decider.hpp"
+#include "far_decider.hpp"
+#include "flat_machine.hpp"
+#include "static_analyzer.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+using std::cout;
+using std::endl;
+
+const char* const DEFAULT_PIPELINE_STAGES = "static,flat,proof";
+
+namespace {
+
+class StaticDecider : public Decider {
+ public:
+  DeciderResult decide(const RuleTable& rule_table) override {
+    StaticAnalysis analysis = analyze_rule_table(rule_table);
+    BigNum num_ones = analysis.state == STATE_HALT ? analysis.num_ones : -1;
+    return DeciderResult{analysis.state, num_ones, analysis.num_steps,
+                         analysis.reason ? analysis.reason : ""};
+  }
+};
+
+class FlatDecider : public Decider {
+ public:
+  explicit FlatDecider(uint64_t max_num_steps)
+      : max_num_steps_(max_num_steps) {}
+  DeciderResult decide(const RuleTable& rule_table) override {
+    FlatMachine machine(rule_table);
+    if (!machine.run(max_num_steps_)) {
+      return DeciderResult{STATE_INCOMPLETE, -1, machine.num_steps(), ""};
+    }
+    return DeciderResult{machine.state(), machine.num_ones(),
+                         machine.num_steps(), "halted"};
+  }
+
+ private:
+  const uint64_t max_num_steps_;
+};
+
+class CyclerDecider : public Decider {
+ public:
+  CyclerDecider(uint64_t max_num_steps, bool translated)
+      : max_num_steps_(max_num_steps), translated_(translated) {}
+  DeciderResult decide(const RuleTable& rule_table) override {
+    CyclerResult cycler =
+        translated_ ? decide_translated_cycler(rule_table, max_num_steps_)
+                    : decide_cycler(rule_table, max_num_steps_);
+    std::stringstream details;
+    if (cycler.state == STATE_NOHALT) {
+      details << (translated_ ? "translated cycle" : "cycle") << " of length "
+              << cycler.cycle_length;
+      if (translated_) details << " shifting " << cycler.shift << " cells";
+    } else if (cycler.state == STATE_HALT) {
+      details << "halted";
+    }
+    BigNum num_ones = cycler.state == STATE_HALT ? BigNum(cycler.num_ones) : -1;
+    return DeciderResult{cycler.state, num_ones, cycler.num_steps,
+                         details.str()};
+  }
+
+ private:
+  const uint64_t max_num_steps_;
+  const bool translated_;
+};
+
+class BackwardDecider : public Decider {
+ public:
+  explicit BackwardDecider(int max_depth) : max_depth_(max_depth) {}
+  DeciderResult decide(const RuleTable& rule_table) override {
+    BackwardResult backward = decide_backward(rule_table, max_depth_);
+    std::stringstream details;
+    details << "no halting transition is reachable (reasoned back "
+            << backward.depth << " steps)";
+    return DeciderResult{backward.state, -1, 0,
+                         backward.state == STATE_NOHALT ? details.str() : ""};
+  }
+
+ private:
+  const int max_depth_;
+};
+
+class FarDecider : public Decider {
+ public:
+  FarDecider(int max_dfa_size, double max_seconds)
+      : max_dfa_size_(max_dfa_size), max_seconds_(max_seconds) {}
+  DeciderResult decide(const RuleTable& rule_table) override {
+    FarResult far = decide_far(rule_table, max_dfa_size_, max_seconds_);
+    std::stringstream details;
+    details << "closed tape language with a " << far.dfa_size << "-state DFA"
+            << (far.mirrored ? " (mirrored)" : "") << " after " << far.num_dfas
+            << " DFAs";
+    return DeciderResult{far.state, -1, 0,
+                         far.state == STATE_NOHALT ? details.str() : ""};
+  }
+
+ private:
+  const int max_dfa_size_;
+  const double max_seconds_;
+};
+
+class ProofDecider : public Decider {
+ public:
+  ProofDecider(int macro_nbit, const TMOptions& options)
+      : macro_nbit_(macro_nbit), options_(options) {}
+  DeciderResult decide(const RuleTable& rule_table) override {
+    return decide_resumed(rule_table, nullptr, nullptr);
+  }
+  DeciderResult decide_resumed(const RuleTable& rule_table,
+                               const TMSnapshot* parent,
+                               TMSnapshot* snapshot) override {
+    TMResult result = run_turing_machine(rule_table, macro_nbit_, options_,
+                                         parent, snapshot);
+    return DeciderResult{result.state, result.num_ones, result.num_steps,
+                         parent ? "resumed with proofs"
+                                : "simulated with proofs"};
+  }
+
+ private:
+  const int macro_nbit_;
+  const TMOptions options_;
+};
+
+// Splits s at each occurrence of sep.
+std::vector<std::string> split(const std::string& s, char sep) {
+  std::vector<std::string> parts;
+  std::stringstream ss(s);
+  std::string part;
+  while (std::getline(ss, part, sep)) parts.push_back(part);
+  return parts;
+}
+
+template <typename T>
+T parse_budget(const std::string& stage, const std::string& budget, T min_value,
+               T max_value) {
+  std::stringstream ss(budget);
+  T value;
+  if (!(ss >> value) || !ss.eof() || value < min_value || value > max_value) {
+    throw std::runtime_error("Invalid budget \"" + budget + "\" in stage \"" +
+                             stage + "\"");
+  }
+  return value;
+}
+
+std::unique_ptr<Decider> make_decider(const std::string& stage, int macro_nbit,
+                                      const TMOptions& options) {
+  std::vector<std::string> parts = split(stage, ':');
+  if (parts.empty()) throw std::runtime_error("Empty pipeline stage");
+  const std::string& name = parts[0];
+  size_t max_num_budgets =
+      name == "static" || name == "proof" ? 0 : name == "far" ? 2 : 1;
+  if (parts.size() - 1 > max_num_budgets) {
+    throw std::runtime_error("Too many budgets in stage \"" + stage + "\"");
+  }
+  auto budget = [&](size_t i, const char* default_value) {
+    return i < parts.size() ? parts[i] : std::string(default_value);
+  };
+  const uint64_t max_steps = -1;
+  if (name == "static") {
+    return std::unique_ptr<Decider>(new StaticDecider());
+  } else if (name == "flat") {
+    return std::unique_ptr<Decider>(new FlatDecider(
+        parse_budget<uint64_t>(stage, budget(1, "65536"), 0, max_steps)));
+  } else if (name == "cycler" || name == "translated") {
+    return std::unique_ptr<Decider>(new CyclerDecider(
+        parse_budget<uint64_t>(stage, budget(1, "65536"), 0, max_steps),
+        name == "translated"));
+  } else if (name == "backward") {
+    return std::unique_ptr<Decider>(new BackwardDecider(
+        parse_budget<int>(stage, budget(1, "30"), 0, MAX_BACKWARD_DEPTH)));
+  } else if (name == "far") {
+    return std::unique_ptr<Decider>(new FarDecider(
+        parse_budget<int>(stage, budget(1, "4"), 1, MAX_FAR_DFA_SIZE),
+        parse_budget<double>(stage, budget(2, "1"), 0, 1e9)));
+  } else if (name == "proof") {
+    return std::unique_ptr<Decider>(new ProofDecider(macro_nbit, options));
+  }
+  throw std::runtime_error("Unknown pipeline stage \"" + name + "\"");
+}
+
+}  // end namespace
+
+DeciderPipeline::DeciderPipeline(const std::string& stages, int macro_nbit,
+                                 const TMOptions& options)
+    : silent_(options.silent) {
+  for (const std::string& stage : split(stages, ',')) {
+    deciders_.push_back(make_decider(stage, macro_nbit, options));
+    stats_.emplace_back();
+    stats_.back().name = stage;
+  }
+}
+
+DeciderPipeline::~DeciderPipeline() {}
+
+TMResult DeciderPipeline::run(const RuleTable& rule_table, std::string* stage,
+                              const TMSnapshot* parent, TMSnapshot* snapshot) {
+  if (stage) stage->clear();
+  if (snapshot) snapshot->proof_machine.reset();
+  for (size_t i = 0; i < deciders_.size(); ++i) {
+    auto start_time = std::chrono::steady_clock::now();
+    DeciderResult result =
+        deciders_[i]->decide_resumed(rule_table, parent, snapshot);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_time;
+    StageStats& stats = stats_[i];
+    ++stats.num_runs;
+    stats.num_seconds += elapsed.count();
+    stats.num_steps += result.num_steps;
+    if (result.state == STATE_INCOMPLETE) continue;
+    ++(result.state == STATE_HALT ? stats.num_halted : stats.num_nonhalting);
+    if (stage) *stage = stats.name;
+    if (!silent_) {
+      cout << "Decided by " << stats.name << ": " << result.details;
+      if (result.num_steps != 0) {
+        cout << " after " << ConcisePrintBigNum(result.num_steps) << " steps";
+      }
+      cout << endl;
+    }
+    return TMResult{result.num_ones, result.num_steps, result.state};
+  }
+  return TMResult{-1, 0, STATE_INCOMPLETE};
+}
+
+void DeciderPipeline::merge_stats(const DeciderPipeline& other) {
+  assert(other.stats_.size() == stats_.size());
+  for (size_t i = 0; i < stats_.size(); ++i) {
+    StageStats& stats = stats_[i];
+    const StageStats& other_stats = other.stats_[i];
+    assert(other_stats.name == stats.name);
+    stats.num_runs += other_stats.num_runs;
+    stats.num_halted += other_stats.num_halted;
+    stats.num_nonhalting += other_stats.num_nonhalting;
+    stats.num_seconds += other_stats.num_seconds;
+    stats.num_steps += other_stats.num_steps;
+  }
+}
+
+void DeciderPipeline::print_stats(std::ostream& os) const {
+  char line[256];
+  snprintf(line, sizeof(line), "%-24s %10s %10s %10s %12s", "Stage", "Runs",
+           "Halted", "Nonhalting", "Seconds");
+  os << line << "  Steps" << endl;
+  for (const StageStats& stats : stats_) {
+    snprintf(line, sizeof(line), "%-24s %10llu %10llu %10llu %12.6f",
+             stats.name.c_str(), (unsigned long long)stats.num_runs,
+             (unsigned long long)stats.num_halted,
+             (unsigned long long)stats.num_nonhalting, stats.num_seconds);
+    os << line << "  " << ConcisePrintBigNum(stats.num_steps) << endl;
+  }
+}
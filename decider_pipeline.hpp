@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "bignum.hpp"
+#include "rule_table.hpp"
+#include "turing_machine.hpp"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct DeciderResult {
+  // STATE_HALT or STATE_NOHALT if the machine was decided, otherwise
+  // STATE_INCOMPLETE.
+  uint32_t state;
+  BigNum num_ones;   // The no. ones on the tape if it halted, otherwise -1.
+  BigNum num_steps;  // The no. steps simulated.
+  std::string details;  // How the machine was decided.
+};
+
+// One stage of a DeciderPipeline.
+class Decider {
+ public:
+  virtual ~Decider() {}
+  virtual DeciderResult decide(const RuleTable& rule_table) = 0;
+  // Like decide, but for a machine that can be resumed from parent (if it is
+  // not null; see run_turing_machine), saving a snapshot of its own to
+  // snapshot (if it is not null) if it halts and the decider can. By default,
+  // the machine is decided from scratch and no snapshot is saved.
+  virtual DeciderResult decide_resumed(const RuleTable& rule_table,
+                                       const TMSnapshot* parent,
+                                       TMSnapshot* snapshot) {
+    return decide(rule_table);
+  }
+};
+
+// The stages that single machines are run through by default. Each stage
+// starts again from a blank tape, so the other deciders (which only pay off
+// for machines that the proof stage cannot decide) are opt-in.
+extern const char* const DEFAULT_PIPELINE_STAGES;
+
+// Runs a machine through an ordered list of deciders until one of them decides
+// it, and keeps statistics on each stage across all the machines it runs.
+//
+// The stages are given as a comma-separated list of decider names, each
+// optionally followed by colon-separated budgets:
+//   static                     analyze_rule_table.
+//   flat[:steps]               Simulate on a FlatMachine (default 65536 steps).
+//   cycler[:steps]             decide_cycler (default 65536 steps).
+//   translated[:steps]         decide_translated_cycler (default 65536 steps).
+//   backward[:depth]           decide_backward (default depth 30).
+//   far[:dfa_size[:seconds]]   decide_far (default 4 states, 1 second).
+//   proof                      run_turing_machine with the given macro_nbit and
+//                              options.
+// Nothing is printed to stdout if options.silent is set.
+// E.g., "flat:1000,backward,proof".
+class DeciderPipeline {
+ public:
+  struct StageStats {
+    std::string name;
+    uint64_t num_runs = 0;
+    uint64_t num_halted = 0;
+    uint64_t num_nonhalting = 0;
+    double num_seconds = 0;
+    BigNum num_steps = 0;
+  };
+
+  // Throws std::runtime_error if stages is invalid.
+  DeciderPipeline(const std::string& stages, int macro_nbit,
+                  const TMOptions& options = TMOptions());
+  ~DeciderPipeline();
+
+  // Runs the stages in order until one decides the machine (otherwise the
+  // result's state is STATE_INCOMPLETE). If stage is not null, it is set to
+  // the name of the deciding stage (or cleared). The stages that can resume
+  // the machine from parent and save snapshots do so (see
+  // Decider::decide_resumed); snapshot's proof_machine is left null if none
+  // was saved.
+  TMResult run(const RuleTable& rule_table, std::string* stage = nullptr,
+               const TMSnapshot* parent = nullptr,
+               TMSnapshot* snapshot = nullptr);
+
+  const std::vector<StageStats>& stats() const { return stats_; }
+  // Adds the stats of other, which must have been constructed with the same
+  // stages, to this pipeline's.
+  void merge_stats(const DeciderPipeline& other);
+  void print_stats(std::ostream& os) const;
+
+ private:
+  std::vector<std::unique_ptr<Decider>> deciders_;
+  std::vector<StageStats> stats_;
+  const bool silent_;
+};
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "far_decider.hpp"
+
+#include "static_analyzer.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+namespace {
+
+// The transitions of a DFA over the symbols {0, 1}, where state 0 is the
+// start state and reading a 0 in it stays there (so that the blank cells at the
+// far left of the tape do not matter).
+struct Dfa {
+  int size;
+  uint8_t next[MAX_FAR_DFA_SIZE][2];
+};
+
+class FarSearch {
+ public:
+  FarSearch(const RuleTable& rule_table, bool mirrored)
+      : rule_table_(rule_table),
+        mirrored_(mirrored),
+        analysis_(analyze_rule_table(rule_table)) {}
+
+  // Returns true if the smallest language recognized with this DFA proves that
+  // the machine never halts.
+  bool try_dfa(const Dfa& dfa) {
+    // The NFA's states are (DFA state, machine state) pairs, entered after
+    // reading the tape left of the head and then the machine's state, plus an
+    // accept-everything state. The NFA's transitions on reading the head's
+    // symbol and the rest of the tape are the smallest that make the language
+    // closed.
+    const int top = dfa.size * STATE_HALT;
+    const uint64_t top_bit = uint64_t(1) << top;
+    for (int i = 0; i < top; ++i) nfa_[0][i] = nfa_[1][i] = 0;
+    nfa_[0][top] = nfa_[1][top] = top_bit;
+    for (bool changed = true; changed;) {
+      changed = false;
+      for (uint32_t state = 0; state < STATE_HALT; ++state) {
+        for (int symbol = 0; symbol < 2; ++symbol) {
+          // The language only needs to be closed under the transitions that
+          // the machine can take.
+          if (!analysis_.can_take(state, symbol)) continue;
+          Rule rule = rule_table_(symbol, state);
+          bool move_right = rule.move_right != mirrored_;
+          for (int q = 0; q < dfa.size; ++q) {
+            if (rule.state >= STATE_HALT) {
+              // Every configuration that halts next must be accepted.
+              changed |= add(symbol, index(q, state), top_bit);
+            } else if (move_right) {
+              // L [state] symbol R -> L rule.symbol [rule.state] R.
+              int q_after = dfa.next[q][rule.symbol];
+              changed |= add(symbol, index(q, state),
+                             uint64_t(1) << index(q_after, rule.state));
+            } else {
+              // L l [state] symbol R -> L [rule.state] l rule.symbol R.
+              for (int l = 0; l < 2; ++l) {
+                uint64_t after = multiply(
+                    nfa_[l][index(q, rule.state)], nfa_[rule.symbol]);
+                changed |= add(symbol, index(dfa.next[q][l], state), after);
+              }
+            }
+          }
+        }
+      }
+    }
+    // Accept the states from which the accept-everything state can be reached
+    // by reading 0s, which makes acceptance unaffected by the blank cells at
+    // the far right of the tape.
+    uint64_t accept = top_bit;
+    for (bool changed = true; changed;) {
+      uint64_t new_accept = accept;
+      for (int i = 0; i < top; ++i) {
+        if (nfa_[0][i] & accept) new_accept |= uint64_t(1) << i;
+      }
+      changed = new_accept != accept;
+      accept = new_accept;
+    }
+    // The starting configuration (a blank tape in state A) must be rejected.
+    return !(accept & (uint64_t(1) << index(0, 0)));
+  }
+
+ private:
+  static int index(int dfa_state, uint32_t state) {
+    return dfa_state * STATE_HALT + state;
+  }
+
+  // Adds transitions from NFA state i on reading symbol, and returns true if
+  // any were new.
+  bool add(int symbol, int i, uint64_t targets) {
+    uint64_t& row = nfa_[symbol][i];
+    if ((row | targets) == row) return false;
+    row |= targets;
+    return true;
+  }
+
+  // Returns the NFA states reached from the set of states on reading one
+  // symbol with the given transitions.
+  static uint64_t multiply(uint64_t states, const uint64_t* transitions) {
+    uint64_t result = 0;
+    for (; states; states &= states - 1) {
+      result |= transitions[__builtin_ctzll(states)];
+    }
+    return result;
+  }
+
+  const RuleTable& rule_table_;
+  const bool mirrored_;
+  const StaticAnalysis analysis_;
+  // Indexed by symbol and then NFA state.
+  uint64_t nfa_[2][MAX_FAR_DFA_SIZE * STATE_HALT + 1];
+};
+
+// Calls visit(dfa) for each DFA with dfa.size states (up to isomorphism, by
+// requiring the states to be numbered in the order in which they are first
+// reached), until it returns true, and returns whether it did.
+template <class Visitor>
+bool enumerate_dfas(Dfa* dfa, int num_used_states, int transition,
+                    Visitor& visit) {
+  if (transition == 2 * dfa->size) {
+    return num_used_states == dfa->size && visit(*dfa);
+  }
+  int q = transition / 2;
+  int symbol = transition % 2;
+  if (q >= num_used_states) return false;  // State q is unreachable.
+  if (transition == 0) {
+    dfa->next[0][0] = 0;
+    return enumerate_dfas(dfa, num_used_states, 1, visit);
+  }
+  int max_next = std::min(num_used_states, dfa->size - 1);
+  for (int next = 0; next <= max_next; ++next) {
+    dfa->next[q][symbol] = next;
+    int num_used = std::max(num_used_states, next + 1);
+    if (enumerate_dfas(dfa, num_used, transition + 1, visit)) return true;
+  }
+  return false;
+}
+
+}  // end namespace
+
+FarResult decide_far(const RuleTable& rule_table, int max_dfa_size,
+                     double max_seconds) {
+  assert(0 < max_dfa_size && max_dfa_size <= MAX_FAR_DFA_SIZE);
+  auto start_time = std::chrono::steady_clock::now();
+  FarSearch searches[2] = {FarSearch(rule_table, false),
+                           FarSearch(rule_table, true)};
+  FarResult result = {STATE_INCOMPLETE, 0, false, 0};
+  bool out_of_time = false;
+  auto visit = [&](const Dfa& dfa) {
+    // Check the time only occasionally, as trying a DFA is quick.
+    if (++result.num_dfas % 256 == 0) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start_time;
+      if (elapsed.count() > max_seconds) return out_of_time = true;
+    }
+    for (int i = 0; i < 2; ++i) {
+      if (searches[i].try_dfa(dfa)) {
+        result = FarResult{STATE_NOHALT, dfa.size, (bool)i, result.num_dfas};
+        return true;
+      }
+    }
+    return false;
+  };
+  for (int size = 1; size <= max_dfa_size && !out_of_time; ++size) {
+    Dfa dfa;
+    dfa.size = size;
+    if (enumerate_dfas(&dfa, 1, 0, visit) && !out_of_time) break;
+  }
+  return result;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "rule_table.hpp"
+
+#include <cstdint>
+
+// The largest DFA that decide_far can search with (so that its NFA's states fit
+// in a 64-bit mask).
+enum { MAX_FAR_DFA_SIZE = 10 };
+
+struct FarResult {
+  // STATE_NOHALT if a closed tape language was found, otherwise
+  // STATE_INCOMPLETE.
+  uint32_t state;
+  // If state == STATE_NOHALT, the no. states of the DFA in the language, and
+  // whether it was found for the mirror image of the machine.
+  int dfa_size;
+  bool mirrored;
+  uint64_t num_dfas;  // The no. DFAs tried.
+};
+
+// Decides machines by finite automata reduction: searches for a regular
+// language of tape configurations that contains every configuration from which
+// the machine can halt, is closed under stepping backwards, and does not
+// contain the starting configuration, which proves that the machine never
+// halts.
+//
+// The language is recognized by a DFA that reads the tape left of the head,
+// followed by an NFA that reads the machine's state and the rest of the tape.
+// Every DFA with up to max_dfa_size states is tried in turn (smallest first,
+// each up to isomorphism), for both the machine and its mirror image. For a
+// given DFA, the smallest NFA that satisfies the closure conditions is found
+// directly as a fixed point, so the only search is over the DFAs.
+//
+// Gives up (returning STATE_INCOMPLETE) once the DFAs run out or max_seconds
+// have passed.
+FarResult decide_far(const RuleTable& rule_table, int max_dfa_size,
+                     double max_seconds);
@@ -35,7 +35,9 @@
 // Same API as std::list, but all memory is stored in a single std::vector.
 // Note that unlike std::list, this will potentially invalidate iterators after
 // a move-construct/assign (because iterators hold a reference to their original
-// FastList object).
+// FastList object). Copies and moves keep each element at the same index,
+// however, so rebind() can map an iterator into the list that was copied or
+// moved from to the corresponding iterator into the new list.
 template <typename T, class Allocator = std::allocator<T>,
           typename SizeType = int>  // TODO: SizeType being signed is hacky.
 class FastList {
@@ -146,12 +148,12 @@ class FastList {
   ~FastList() {
     while (!empty()) pop_back();
   }
-  FastList(const FastList& other) : FastList() {
-    for (const auto& item : other) emplace_back(item);
-  }
+  FastList(const FastList& other) : FastList() { copy_from(other); }
   FastList& operator=(const FastList& other) {
-    while (!empty()) pop_back();
-    for (const auto& item : other) emplace_back(item);
+    if (this != &other) {
+      while (!empty()) pop_back();
+      copy_from(other);
+    }
     return *this;
   }
 
@@ -228,6 +230,35 @@ class FastList {
     --size_;
     return next_it;
   }
+  // Moves the element at it to before pos. Unlike std::list, this only
+  // supports moving elements within the same list.
+  void splice(const_iterator pos, FastList& other, const_iterator it) {
+    assert(&other == this);
+    assert(it != end());
+    if (pos == it || pos.index_ == nodes_[it.index_].next) return;
+    // Unlink.
+    size_type prev_index = nodes_[it.index_].prev;
+    size_type next_index = nodes_[it.index_].next;
+    nodes_[prev_index].next = next_index;
+    nodes_[next_index].prev = prev_index;
+    // Relink before pos.
+    prev_index = nodes_[pos.index_].prev;
+    nodes_[it.index_].next = pos.index_;
+    nodes_[it.index_].prev = prev_index;
+    nodes_[prev_index].next = it.index_;
+    nodes_[pos.index_].prev = it.index_;
+  }
+  // Returns the iterator into this list at the same position as it is in the
+  // list that this one was copied or moved from.
+  template <typename C, typename N, typename P, typename R>
+  iterator rebind(const Iterator<C, N, P, R>& it) {
+    return iterator(this, it.index_);
+  }
+  template <typename C, typename N, typename P, typename R>
+  const_iterator rebind(const Iterator<C, N, P, R>& it) const {
+    return const_iterator(this, it.index_);
+  }
+
   iterator begin() { return std::next(iterator(this, 0)); }
   iterator end() { return iterator(this, 0); }
   const_iterator begin() const { return std::next(const_iterator(this, 0)); }
@@ -238,6 +269,8 @@ class FastList {
   void pop_back() { erase(std::prev(end())); }
   size_type size() const { return size_; }
   bool empty() const { return size_ == 0; }
+  // Returns the no. elements that the list can hold without allocating.
+  size_type capacity() const { return nodes_.capacity() - 1; }
   reference front() { return *begin(); }
   const_reference front() const { return *begin(); }
   reference back() { return *std::prev(end()); }
@@ -252,6 +285,23 @@ class FastList {
   }
 
  private:
+  // Copies the links of every node (including free ones) and the elements at
+  // the same indices. This list must be empty.
+  void copy_from(const FastList& other) {
+    nodes_.resize(other.nodes_.size());
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+      nodes_[i].next = other.nodes_[i].next;
+      nodes_[i].prev = other.nodes_[i].prev;
+    }
+    node_allocator_type allocator;
+    for (auto it = other.begin(); it != other.end(); ++it) {
+      std::allocator_traits<node_allocator_type>::construct(
+          allocator, nodes_[it.index_].value_ptr(), *it);
+    }
+    free_head_ = other.free_head_;
+    size_ = other.size_;
+  }
+
   std::vector<Node, node_allocator_type> nodes_;
   size_type free_head_;
   size_type size_;
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flat_machine.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+FlatMachine::FlatMachine(const RuleTable& rule_table, bool track_hash)
+    : state_(0),
+      num_steps_(0),
+      num_ones_(0),
+      words_(2, 0),
+      head_(64),
+      origin_(64),
+      track_hash_(track_hash),
+      tape_hash_(0) {
+  set_transitions(rule_table);
+}
+
+FlatMachine::FlatMachine(const FlatMachine& parent, const RuleTable& rule_table)
+    : FlatMachine(parent) {
+  int undefined_rule = parent.undefined_rule();
+  assert(undefined_rule >= 0);
+  assert(!rule_table.is_undefined(undefined_rule % 2, undefined_rule / 2));
+  // Undefined rules write a 1 and move right.
+  --head_;
+  if (undefined_rule % 2 == 0) {
+    words_[head_ / 64] &= ~(uint64_t(1) << (head_ % 64));
+    --num_ones_;
+    if (track_hash_) tape_hash_ ^= detail::mix64(head_ - origin_);
+  }
+  state_ = undefined_rule / 2;
+  --num_steps_;
+  set_transitions(rule_table);
+}
+
+void FlatMachine::set_transitions(const RuleTable& rule_table) {
+  for (uint32_t state = 0; state < STATE_HALT; ++state) {
+    for (int symbol = 0; symbol < 2; ++symbol) {
+      Rule rule = rule_table(symbol, state);
+      uint8_t next_state = rule_table.is_undefined(symbol, state)
+                               ? FIRST_UNDEFINED_STATE + state * 2 + symbol
+                               : rule.state;
+      transitions_[state * 2 + symbol] = Transition{
+          next_state, (uint8_t)rule.symbol, (bool)rule.move_right};
+    }
+  }
+}
+
+bool FlatMachine::run(uint64_t max_num_steps) {
+  return track_hash_ ? run_steps<true>(max_num_steps)
+                     : run_steps<false>(max_num_steps);
+}
+
+template <bool TRACK_HASH>
+bool FlatMachine::run_steps(uint64_t max_num_steps) {
+  uint64_t* words = words_.data();
+  int64_t num_cells = tape_size();
+  for (uint64_t i = 0; i < max_num_steps && state_ < STATE_HALT; ++i) {
+    uint64_t& word = words[head_ / 64];
+    uint64_t mask = uint64_t(1) << (head_ % 64);
+    int symbol = (word & mask) != 0;
+    const Transition& transition = transitions_[state_ * 2 + symbol];
+    word = transition.symbol ? word | mask : word & ~mask;
+    num_ones_ += transition.symbol - symbol;
+    if (TRACK_HASH && transition.symbol != symbol) {
+      tape_hash_ ^= detail::mix64(head_ - origin_);
+    }
+    state_ = transition.state;
+    head_ += transition.move_right ? 1 : -1;
+    ++num_steps_;
+    if (head_ < 0 || head_ == num_cells) {
+      grow_tape();
+      words = words_.data();
+      num_cells = tape_size();
+    }
+  }
+  return stopped();
+}
+
+void FlatMachine::grow_tape() {
+  // The tape is doubled in size towards the end that the head ran off.
+  size_t num_words = words_.size();
+  if (head_ < 0) {
+    words_.insert(words_.begin(), num_words, 0);
+    head_ += num_words * 64;
+    origin_ += num_words * 64;
+  } else {
+    words_.resize(2 * num_words, 0);
+  }
+}
+
+bool FlatMachine::same_configuration(const FlatMachine& other) const {
+  if (state_ != other.state_ || head_position() != other.head_position() ||
+      num_ones_ != other.num_ones_) {
+    return false;
+  }
+  // Compare every word that is on either tape. Both origins are multiples of
+  // 64, so the words line up.
+  int64_t begin = std::min(-origin_, -other.origin_) / 64;
+  int64_t end =
+      std::max((int64_t)words_.size() * 64 - origin_,
+               (int64_t)other.words_.size() * 64 - other.origin_) / 64;
+  for (int64_t i = begin; i < end; ++i) {
+    if (word_at(i) != other.word_at(i)) return false;
+  }
+  return true;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "rule_table.hpp"
+#include "util.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Simulates a machine one step at a time on an uncompressed tape of bits
+// packed into words, with plain 64-bit counters. This has none of the setup or
+// per-step overheads of the macro and proof machines, which makes it the
+// fastest way to run the many machines that halt within a few thousand steps.
+class FlatMachine {
+ public:
+  // If track_hash is true, a hash of the tape is maintained as the machine runs
+  // (at a small cost per step) so that configuration_hash() is O(1).
+  explicit FlatMachine(const RuleTable& rule_table, bool track_hash = false);
+  // Forks parent, which must have halted on an undefined rule, for a rule
+  // table that defines that rule (and is otherwise the same). The halting
+  // step is taken back, so the new machine resumes from where parent halted.
+  FlatMachine(const FlatMachine& parent, const RuleTable& rule_table);
+  FlatMachine(const FlatMachine&) = default;
+  FlatMachine(FlatMachine&&) = default;
+  FlatMachine& operator=(const FlatMachine&) = default;
+  FlatMachine& operator=(FlatMachine&&) = default;
+
+  // Runs the machine for up to max_num_steps more steps, and returns true if
+  // it stopped (i.e., reached STATE_HALT or another terminal state).
+  bool run(uint64_t max_num_steps);
+
+  uint32_t state() const {
+    return state_ < FIRST_UNDEFINED_STATE ? state_ : (uint32_t)STATE_HALT;
+  }
+  bool stopped() const { return state_ >= STATE_HALT; }
+  // If the machine halted on an undefined rule (see RuleTable), returns
+  // 2 * state + symbol for that rule, otherwise -1.
+  int undefined_rule() const {
+    return state_ < FIRST_UNDEFINED_STATE ? -1
+                                          : state_ - FIRST_UNDEFINED_STATE;
+  }
+  uint64_t num_steps() const { return num_steps_; }
+  uint64_t num_ones() const { return num_ones_; }
+  // The no. cells that the tape currently has room for (which grows to cover
+  // every cell the head has visited).
+  size_t tape_size() const { return words_.size() * 64; }
+  // The head's position relative to where it started.
+  int64_t head_position() const { return head_ - origin_; }
+  // Returns the symbol at the given position (relative to where the head
+  // started), which is 0 for cells that are not yet on the tape.
+  int symbol_at(int64_t position) const {
+    int64_t i = position + origin_;
+    if (i < 0 || i >= (int64_t)tape_size()) return 0;
+    return (words_[i / 64] >> (i % 64)) & 1;
+  }
+
+  // Returns a hash of the state, head position and tape contents. Requires
+  // track_hash.
+  uint64_t configuration_hash() const {
+    return detail::hash_combine(tape_hash_, state_, head_position());
+  }
+  // Returns true if this machine is in the same state, at the same head
+  // position and with the same tape contents as other (which may have grown
+  // its tape differently).
+  bool same_configuration(const FlatMachine& other) const;
+
+ private:
+  // Undefined rules are run as "H1R" rules that change to this state plus
+  // 2 * state + symbol, which records the rule that was reached at no cost per
+  // step.
+  enum { FIRST_UNDEFINED_STATE = 16 };
+
+  struct Transition {
+    uint8_t state;
+    uint8_t symbol;
+    bool move_right;
+  };
+
+  void set_transitions(const RuleTable& rule_table);
+
+  // Grows the tape so that the head (which has just moved one cell past the
+  // left or right end) is on it.
+  void grow_tape();
+
+  template <bool TRACK_HASH>
+  bool run_steps(uint64_t max_num_steps);
+
+  // Returns the given word of the tape (which is zero outside of words_),
+  // indexed relative to the word containing the starting cell.
+  uint64_t word_at(int64_t word_position) const {
+    int64_t i = word_position + origin_ / 64;
+    return 0 <= i && i < (int64_t)words_.size() ? words_[i] : 0;
+  }
+
+  // Indexed by state * 2 + symbol.
+  Transition transitions_[2 * STATE_HALT];
+  uint32_t state_;
+  uint64_t num_steps_;
+  uint64_t num_ones_;
+  std::vector<uint64_t> words_;
+  int64_t head_;    // Index of the head's cell within the tape.
+  int64_t origin_;  // Index of the starting cell within the tape.
+  bool track_hash_;
+  // XOR of detail::mix64 over the positions of all cells that are 1.
+  uint64_t tape_hash_;
+};
@@ -42,44 +42,58 @@ void MacroMachine::step(MacroMachineState* mstate, BigNum* num_micro_steps,
                         bool* did_jump) const {
   MicroMachineState rule{mstate->state, mstate->cur_span->symbol,
                          mstate->moving_right};
-  BigNum this_num_micro_steps = micro_machine_.step(&rule);
+  // Note: The BigNums are members so that their storage is reused.
+  BigNum& this_num_micro_steps = this_num_micro_steps_;
+  this_num_micro_steps = micro_machine_.step(&rule);
   if (this_num_micro_steps_ptr)
     *this_num_micro_steps_ptr = this_num_micro_steps;
   if (did_jump) *did_jump = false;
 
   if (rule.state == STATE_NOHALT) {
-    // TODO: Return this via a msg or similar instead of printing.
-    cout << "INFINITE MICROLOOP" << endl;
+    mstate->nohalt_reason = "INFINITE MICROLOOP";
     mstate->state = STATE_NOHALT;
     return;
   }
-  BigNum this_num_macro_steps;
+  if (rule.state == STATE_HALT) {
+    // The tape is left as it is so that the machine can be resumed.
+    mstate->halting_state = mstate->state;
+    mstate->halting_symbol = rule.symbol;
+    mstate->halting_num_micro_steps = this_num_micro_steps.get_si();
+    mstate->state = STATE_HALT;
+    *num_micro_steps += this_num_micro_steps;
+    return;
+  }
+  BigNum& this_num_macro_steps = this_num_macro_steps_;
   if (rule.state == mstate->state && rule.move_right == mstate->moving_right) {
     // No state change, can jump.
     // Check for infinite walk at end of tape.
     if ((rule.move_right && mstate->cur_span == --mstate->tape.end()) ||
         (!rule.move_right && mstate->cur_span == mstate->tape.begin())) {
-      cout << "INFINITE WALK" << endl;
+      mstate->nohalt_reason = "INFINITE WALK";
       mstate->state = STATE_NOHALT;
       return;
     }
-    BigNum jump = mstate->cur_span->size;
+    const BigNum& jump = mstate->cur_span->size;
     if (did_jump) *did_jump = true;
     this_num_micro_steps *= jump;
-    this_num_macro_steps = rule.move_right ? jump : -jump;
+    if (rule.move_right) {
+      this_num_macro_steps = jump;
+    } else {
+      this_num_macro_steps = -jump;
+    }
     if (rule.move_right && rule.symbol == std::prev(mstate->cur_span)->symbol) {
       // Keep the older span, erase the newer one (enables more proofs).
       if (std::prev(mstate->cur_span)->id < mstate->cur_span->id) {
         // Extend the prev span to encompass the current span.
         std::prev(mstate->cur_span)->size += mstate->cur_span->size;
         if (deleted_span_id) *deleted_span_id = mstate->cur_span->id;
-        mstate->cur_span = mstate->tape.erase(mstate->cur_span);
+        mstate->cur_span = mstate->erase_span(mstate->cur_span);
       } else {
         // Extend the current span to encompass the previous one.
-        mstate->cur_span->symbol = rule.symbol;
+        mstate->set_span_symbol(mstate->cur_span, rule.symbol);
         mstate->cur_span->size += std::prev(mstate->cur_span)->size;
         if (deleted_span_id) *deleted_span_id = std::prev(mstate->cur_span)->id;
-        mstate->tape.erase(std::prev(mstate->cur_span));
+        mstate->erase_span(std::prev(mstate->cur_span));
         mstate->cur_span = std::next(mstate->cur_span);
       }
     } else if (!rule.move_right &&
@@ -89,22 +103,25 @@ void MacroMachine::step(MacroMachineState* mstate, BigNum* num_micro_steps,
         // Extend the next span to encompass the current span.
         std::next(mstate->cur_span)->size += mstate->cur_span->size;
         if (deleted_span_id) *deleted_span_id = mstate->cur_span->id;
-        mstate->cur_span = --mstate->tape.erase(mstate->cur_span);
+        mstate->cur_span = --mstate->erase_span(mstate->cur_span);
       } else {
         // Extend the current span to encompass the next one.
-        mstate->cur_span->symbol = rule.symbol;
+        mstate->set_span_symbol(mstate->cur_span, rule.symbol);
         mstate->cur_span->size += std::next(mstate->cur_span)->size;
         if (deleted_span_id) *deleted_span_id = std::next(mstate->cur_span)->id;
-        mstate->tape.erase(std::next(mstate->cur_span));
+        mstate->erase_span(std::next(mstate->cur_span));
         mstate->cur_span = std::prev(mstate->cur_span);
       }
+      --mstate->cur_span_idx;
     } else {
       // Change current span's symbol (it may also stay the same).
-      mstate->cur_span->symbol = rule.symbol;
+      mstate->set_span_symbol(mstate->cur_span, rule.symbol);
       if (rule.move_right) {
         mstate->cur_span = std::next(mstate->cur_span);
+        ++mstate->cur_span_idx;
       } else {
         mstate->cur_span = std::prev(mstate->cur_span);
+        --mstate->cur_span_idx;
       }
     }
   } else {  // Can only take a single macro step.
@@ -123,7 +140,7 @@ void MacroMachine::step(MacroMachineState* mstate, BigNum* num_micro_steps,
         if (shrunk_span) *shrunk_span = mstate->cur_span;
         if (mstate->cur_span->size == 0) {
           if (deleted_span_id) *deleted_span_id = mstate->cur_span->id;
-          mstate->cur_span = mstate->tape.erase(mstate->cur_span);
+          mstate->cur_span = mstate->erase_span(mstate->cur_span);
         }
       }
     } else if (!rule.move_right &&
@@ -138,65 +155,68 @@ void MacroMachine::step(MacroMachineState* mstate, BigNum* num_micro_steps,
         if (shrunk_span) *shrunk_span = mstate->cur_span;
         if (mstate->cur_span->size == 0) {
           if (deleted_span_id) *deleted_span_id = mstate->cur_span->id;
-          mstate->cur_span = --mstate->tape.erase(mstate->cur_span);
+          mstate->cur_span = --mstate->erase_span(mstate->cur_span);
+          --mstate->cur_span_idx;
         }
       }
     } else if (rule.move_right && mstate->moving_right) {
       // Insert new size-1 span before current span.
-      mstate->tape.insert(mstate->cur_span,
-                          TapeSpan{rule.symbol, 1, mstate->span_id_counter++});
+      mstate->insert_span(mstate->cur_span, rule.symbol, 1);
+      ++mstate->cur_span_idx;
       if (mstate->cur_span != std::prev(mstate->tape.end())) {
         mstate->cur_span->size -= 1;
         if (shrunk_span) *shrunk_span = mstate->cur_span;
         if (mstate->cur_span->size == 0) {
           if (deleted_span_id) *deleted_span_id = mstate->cur_span->id;
-          mstate->cur_span = mstate->tape.erase(mstate->cur_span);
+          mstate->cur_span = mstate->erase_span(mstate->cur_span);
         }
       }
     } else if (!rule.move_right && !mstate->moving_right) {
       // Insert new size-1 span after current span.
-      mstate->tape.insert(std::next(mstate->cur_span),
-                          TapeSpan{rule.symbol, 1, mstate->span_id_counter++});
+      mstate->insert_span(std::next(mstate->cur_span), rule.symbol, 1);
       if (mstate->cur_span != mstate->tape.begin()) {
         mstate->cur_span->size -= 1;
         if (shrunk_span) *shrunk_span = mstate->cur_span;
         if (mstate->cur_span->size == 0) {
           if (deleted_span_id) *deleted_span_id = mstate->cur_span->id;
-          mstate->cur_span = --mstate->tape.erase(mstate->cur_span);
+          mstate->cur_span = --mstate->erase_span(mstate->cur_span);
+          --mstate->cur_span_idx;
         }
       }
     } else if (rule.move_right && !mstate->moving_right) {
       if (rule.symbol != mstate->cur_span->symbol) {
         auto old_span = mstate->cur_span;
-        mstate->cur_span = mstate->tape.insert(
-            std::next(mstate->cur_span),
-            TapeSpan{rule.symbol, 1, mstate->span_id_counter++});
+        mstate->cur_span = mstate->insert_span(std::next(mstate->cur_span),
+                                               rule.symbol, 1);
+        ++mstate->cur_span_idx;
         if (old_span != mstate->tape.begin()) {
           old_span->size -= 1;
           if (shrunk_span) *shrunk_span = old_span;
           if (old_span->size == 0) {
             if (deleted_span_id) *deleted_span_id = old_span->id;
-            mstate->tape.erase(old_span);
+            mstate->erase_span(old_span);
+            --mstate->cur_span_idx;
           }
         }
       }
       mstate->cur_span = std::next(mstate->cur_span);
+      ++mstate->cur_span_idx;
     } else {  // !rule.move_right && mstate->moving_right
       if (rule.symbol != mstate->cur_span->symbol) {
         auto old_span = mstate->cur_span;
-        mstate->cur_span = mstate->tape.insert(
-            mstate->cur_span,
-            TapeSpan{rule.symbol, 1, mstate->span_id_counter++});
+        mstate->cur_span =
+            mstate->insert_span(mstate->cur_span, rule.symbol, 1);
         if (old_span != std::prev(mstate->tape.end())) {
           old_span->size -= 1;
           if (shrunk_span) *shrunk_span = old_span;
           if (old_span->size == 0) {
             if (deleted_span_id) *deleted_span_id = old_span->id;
-            mstate->tape.erase(old_span);
+            mstate->erase_span(old_span);
           }
         }
       }
       mstate->cur_span = std::prev(mstate->cur_span);
+      --mstate->cur_span_idx;
     }
     // Update state.
     mstate->state = rule.state;
@@ -32,6 +32,7 @@
 #include "micro_machine.hpp"
 #include "bignum.hpp"
 
+#include <cassert>
 #include <vector>
 
 typedef uint64_t SpanID;
@@ -85,19 +86,49 @@ inline static std::vector<BigNum> tape_sizes(const Tape& tape) {
   return result;
 }
 
+// Order-sensitive hash of a pair of adjacent span symbols. The hash of a whole
+// tape is the sum of the hashes of all of its adjacent pairs, which allows it
+// to be updated in O(1) when a span is inserted, erased or rewritten.
+inline static uint64_t symbol_pair_hash(MacroSym left, MacroSym right) {
+  return detail::mix64(detail::mix64(left) + right);
+}
+
 struct MacroMachineState {
   uint32_t state;
   Tape tape;
   Tape::iterator cur_span;
   bool moving_right;
   SpanID span_id_counter;
+  int cur_span_idx;       // Index of cur_span within tape.
+  uint64_t symbols_hash;  // Sum of symbol_pair_hash over all adjacent spans.
+  // Why the machine was found not to halt (set when state becomes
+  // STATE_NOHALT).
+  const char* nohalt_reason;
+  // When state becomes STATE_HALT, the tape and head are left as they were
+  // before the macro step in which the machine halted (so that it can be
+  // resumed from there with the rule it halted on defined; see resume()), and
+  // these record the state it was in, the macro symbol that the step left in
+  // place of the current one and the no. micro steps it took.
+  uint32_t halting_state;
+  MacroSym halting_symbol;
+  int64_t halting_num_micro_steps;
+  // The sizes of erased spans, whose storage is reused by the spans inserted
+  // after them, so that steps that insert spans do not allocate. These are
+  // not copied.
+  std::vector<BigNum> spare_sizes;
 
   MacroMachineState()
       : state(0),
         tape(),
         cur_span(tape.end()),
         moving_right(true),
-        span_id_counter(0) {
+        span_id_counter(0),
+        cur_span_idx(1),
+        symbols_hash(symbol_pair_hash(0, 0)),
+        nohalt_reason(nullptr),
+        halting_state(0),
+        halting_symbol(0),
+        halting_num_micro_steps(0) {
     // Note that moving_right=true => start at left edge of current span.
     // These first and last spans represent the infinite empty tape ends and
     // are never modified during processing.
@@ -105,12 +136,129 @@ struct MacroMachineState {
     tape.push_back(TapeSpan{0, 0, span_id_counter++});
     cur_span = std::next(tape.begin());
   }
+
+  // Copies and moves keep cur_span pointing to the same span, so a state can
+  // be snapshotted (or forked) by copying it.
+  MacroMachineState(const MacroMachineState& other)
+      : tape(other.tape), cur_span(tape.rebind(other.cur_span)) {
+    copy_fields(other);
+  }
+  MacroMachineState(MacroMachineState&& other)
+      : tape(std::move(other.tape)), cur_span(tape.rebind(other.cur_span)) {
+    copy_fields(other);
+  }
+  MacroMachineState& operator=(const MacroMachineState& other) {
+    tape = other.tape;
+    cur_span = tape.rebind(other.cur_span);
+    copy_fields(other);
+    return *this;
+  }
+  MacroMachineState& operator=(MacroMachineState&& other) {
+    tape = std::move(other.tape);
+    cur_span = tape.rebind(other.cur_span);
+    copy_fields(other);
+    return *this;
+  }
+
+  // Takes back the macro step in which the machine halted (which must have
+  // been on a rule that has since been defined), so that it can be resumed.
+  void resume(BigNum* num_micro_steps) {
+    assert(state == STATE_HALT);
+    state = halting_state;
+    *num_micro_steps -= halting_num_micro_steps;
+  }
+
+  // The following methods modify the tape while keeping symbols_hash up to
+  // date. Note that they do not update cur_span or cur_span_idx.
+
+  // Inserts a new span before pos and returns an iterator to it.
+  Tape::iterator insert_span(Tape::iterator pos, MacroSym symbol,
+                             int64_t size) {
+    bool has_prev = pos != tape.begin();
+    bool has_next = pos != tape.end();
+    if (has_prev && has_next) {
+      symbols_hash -= symbol_pair_hash(std::prev(pos)->symbol, pos->symbol);
+    }
+    if (has_prev) {
+      symbols_hash += symbol_pair_hash(std::prev(pos)->symbol, symbol);
+    }
+    if (has_next) symbols_hash += symbol_pair_hash(symbol, pos->symbol);
+    BigNum new_size;
+    if (!spare_sizes.empty()) {
+      new_size.swap(spare_sizes.back());
+      spare_sizes.pop_back();
+    }
+    new_size = size;
+    return tape.emplace(
+        pos, TapeSpan{symbol, std::move(new_size), span_id_counter++});
+  }
+
+  // Erases span and returns an iterator to the following span.
+  Tape::iterator erase_span(Tape::iterator span) {
+    bool has_prev = span != tape.begin();
+    bool has_next = std::next(span) != tape.end();
+    if (has_prev) {
+      symbols_hash -= symbol_pair_hash(std::prev(span)->symbol, span->symbol);
+    }
+    if (has_next) {
+      symbols_hash -= symbol_pair_hash(span->symbol, std::next(span)->symbol);
+    }
+    if (has_prev && has_next) {
+      symbols_hash += symbol_pair_hash(std::prev(span)->symbol,
+                                       std::next(span)->symbol);
+    }
+    spare_sizes.emplace_back();
+    spare_sizes.back().swap(span->size);
+    return tape.erase(span);
+  }
+
+  void set_span_symbol(Tape::iterator span, MacroSym symbol) {
+    if (span->symbol == symbol) return;
+    if (span != tape.begin()) {
+      MacroSym prev_symbol = std::prev(span)->symbol;
+      symbols_hash += symbol_pair_hash(prev_symbol, symbol) -
+                      symbol_pair_hash(prev_symbol, span->symbol);
+    }
+    if (std::next(span) != tape.end()) {
+      MacroSym next_symbol = std::next(span)->symbol;
+      symbols_hash += symbol_pair_hash(symbol, next_symbol) -
+                      symbol_pair_hash(span->symbol, next_symbol);
+    }
+    span->symbol = symbol;
+  }
+
+ private:
+  // Copies every field except tape and cur_span.
+  void copy_fields(const MacroMachineState& other) {
+    state = other.state;
+    moving_right = other.moving_right;
+    span_id_counter = other.span_id_counter;
+    cur_span_idx = other.cur_span_idx;
+    symbols_hash = other.symbols_hash;
+    nohalt_reason = other.nohalt_reason;
+    halting_state = other.halting_state;
+    halting_symbol = other.halting_symbol;
+    halting_num_micro_steps = other.halting_num_micro_steps;
+  }
 };
 
+// Returns the no. ones on the tape of a machine that has halted, including
+// those written in the macro step in which it halted.
+inline static BigNum halted_population(const MacroMachineState& mstate) {
+  assert(mstate.state == STATE_HALT);
+  return tape_population(mstate.tape) -
+         __builtin_popcountll(mstate.cur_span->symbol) +
+         __builtin_popcountll(mstate.halting_symbol);
+}
+
 class MacroMachine {
  public:
   MacroMachine(const RuleTable& rule_table, int macro_nbit)
       : micro_machine_(rule_table, macro_nbit) {}
+  // Forks parent for a rule table that defines rules that were undefined in
+  // parent's (see MicroMachine).
+  MacroMachine(const MacroMachine& parent, const RuleTable& rule_table)
+      : micro_machine_(parent.micro_machine_, rule_table) {}
 
   // Performs one update step on the tape, updating the arguments, and returns
   // a pair (num_micro_steps, num_macro_steps).
@@ -122,6 +270,21 @@ class MacroMachine {
             BigNum* this_num_micro_steps_ptr = nullptr,
             bool* did_jump = nullptr) const;
 
+  size_t num_cached_micro_steps() const {
+    return micro_machine_.num_cached_steps();
+  }
+
+  // Returns the undefined rule that mstate halted on (see
+  // MicroMachine::undefined_rule).
+  int undefined_rule(const MacroMachineState& mstate) const {
+    assert(mstate.state == STATE_HALT);
+    return micro_machine_.undefined_rule(MicroMachineState{
+        mstate.halting_state, mstate.cur_span->symbol, mstate.moving_right});
+  }
+
  private:
   MicroMachine micro_machine_;
+  // Scratch for step().
+  mutable BigNum this_num_micro_steps_;
+  mutable BigNum this_num_macro_steps_;
 };
@@ -26,12 +26,18 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "batch_runner.hpp"
 #include "builtin_rule_tables.hpp"
+#include "decider_pipeline.hpp"
 #include "tests.hpp"
+#include "tnf_enumerator.hpp"
 #include "turing_machine.hpp"
 
+#include <cmath>
+#include <fstream>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
 #include <unordered_set>
 
@@ -39,6 +45,12 @@ using std::cerr;
 using std::cout;
 using std::endl;
 
+// The default no. bits per macro symbol. Wide macro symbols let binary counters
+// spend ~2^macro_nbit steps within a single macro step, which no budget can
+// interrupt, so narrow ones are used when running many machines.
+const int DEFAULT_MACRO_NBIT = 60;
+const int DEFAULT_MANY_MACRO_NBIT = 3;
+
 class ArgParser {
  public:
   ArgParser(int argc, char* argv[], int argi = 1)
@@ -63,10 +75,38 @@ class ArgParser {
     return true;
   }
 
+  bool expect(uint64_t* n) {
+    if (!expect_argument()) return false;
+    char* end;
+    *n = strtoull(symbol(), &end, 0);
+    if (*end || end == symbol()) {
+      cerr << "Invalid command line: expected a non-negative integer value, "
+              "got "
+           << symbol() << endl;
+      return false;
+    }
+    next();
+    return true;
+  }
+
+  bool expect(double* x) {
+    if (!expect_argument()) return false;
+    char* end;
+    *x = strtod(symbol(), &end);
+    if (*end || end == symbol()) {
+      cerr << "Invalid command line: expected a numeric value, got "
+           << symbol() << endl;
+      return false;
+    }
+    next();
+    return true;
+  }
+
   bool expect(int* i) {
     if (!expect_argument()) return false;
-    long val = strtol(symbol(), nullptr, 0);
-    if (!val) {
+    char* end;
+    long val = strtol(symbol(), &end, 0);
+    if (*end || end == symbol()) {
       cerr << "Invalid command line: expected an integer value, got "
            << symbol() << endl;
       return false;
@@ -94,10 +134,17 @@ int main(int argc, char* argv[]) {
   bool do_test = false;
   bool do_test_long = false;
   bool verbose = false;
-  int macro_nbit = 60;
+  int macro_nbit = -1;  // -1 => the mode's default.
+  TMOptions options;
+  std::string pipeline_stages;
+  ProofMachineOptions& proof_options = options.proof_options;
   std::string builtin_rule_table_code = "";
   bool list_builtins = false;
   std::string rule_table_str;
+  std::string batch_path;
+  int num_threads = 0;
+  int enumerate_num_states = 0;
+  uint64_t tnf_max_num_steps = 4096;
   ArgParser arg_parser(argc, argv);
   while (arg_parser.has_symbol()) {
     if (arg_parser.accept({"-h", "--help"})) {
@@ -108,13 +155,101 @@ int main(int argc, char* argv[]) {
       cout << "  -t --test                 Run quick tests." << endl;
       cout << "  -T --test_long            Run long tests." << endl;
       cout
-          << "  -k --macro_nbit <int=60>  Set the no. bits per macro symbol to "
-             "<int>."
+          << "  -k --macro_nbit <int>     Set the no. bits per macro symbol to "
+             "<int>"
           << endl;
+      cout << "                            (default " << DEFAULT_MACRO_NBIT
+           << ", or " << DEFAULT_MANY_MACRO_NBIT
+           << " with --batch or --enumerate)." << endl;
       cout
           << "  -b --builtin <name>       Run the builtin rule table with name "
              "<name>."
           << endl;
+      cout << "  -w --window <int=0>       Key patterns on only <int> spans "
+              "either side of"
+           << endl;
+      cout << "                            the head (0 => the whole tape)."
+           << endl;
+      cout << "  -n --nested               Prove patterns made of applications "
+              "of other"
+           << endl;
+      cout << "                            patterns." << endl;
+      cout << "  -a --anchors <str>        Only record the history when the "
+              "head is on a"
+           << endl;
+      cout << "                            tape end ('e'), after a span is "
+              "created or"
+           << endl;
+      cout << "                            deleted ('s'), or in a state and "
+              "direction"
+           << endl;
+      cout << "                            (e.g., 'A>'); combine as in 'esA>'."
+           << endl;
+      cout << "  -f --fixed_schedule       Attempt every confirmed proof at a "
+              "fixed instance"
+           << endl;
+      cout << "                            threshold." << endl;
+      cout << "  -p --pipelined            Detect recurring tape patterns on "
+              "a helper"
+           << endl;
+      cout << "                            thread." << endl;
+      cout << "  -r --load_patterns <file> Start with the proven patterns in "
+              "a pattern"
+           << endl;
+      cout << "                            store (only the proof stage is "
+              "run)."
+           << endl;
+      cout << "  -s --save_patterns <file> Save proven patterns to a pattern "
+              "store (only"
+           << endl;
+      cout << "                            the proof stage is run)." << endl;
+      cout << "  -P --pipeline <stages>    Decide the machine with the "
+              "given stages, e.g.,"
+           << endl;
+      cout << "                            'flat:1000,cycler,proof' (see "
+              "decider_pipeline.hpp)."
+           << endl;
+      cout << "                            Default: " << DEFAULT_PIPELINE_STAGES
+           << endl;
+      cout << "  --max_steps <int>         Stop the proof stage after <int> "
+              "steps."
+           << endl;
+      cout << "  --max_spans <int>         Stop the proof stage once the tape "
+              "has <int> spans."
+           << endl;
+      cout << "  --max_seconds <num>       Stop the proof stage after <num> "
+              "seconds."
+           << endl;
+      cout << "  -i --batch <file>         Run each rule table (one per line) "
+              "in <file> ('-'"
+           << endl;
+      cout << "                            => stdin) and print a JSON result "
+              "line for each"
+           << endl;
+      cout << "                            (--max_seconds defaults to 1, and "
+              "--pipeline to"
+           << endl;
+      cout << "                            " << DEFAULT_BATCH_PIPELINE_STAGES
+           << ")." << endl;
+      cout << "  -e --enumerate <int>      Enumerate the <int>-state machines "
+              "in tree normal"
+           << endl;
+      cout << "                            form, and print those not decided "
+              "(--max_seconds"
+           << endl;
+      cout << "                            defaults to 1)." << endl;
+      cout << "  --tnf_steps <int=4096>    Run each enumerated machine for "
+              "<int> steps"
+           << endl;
+      cout << "                            before its pipeline (which "
+              "defaults to"
+           << endl;
+      cout << "                            " << DEFAULT_TNF_PIPELINE_STAGES
+           << ")." << endl;
+      cout << "  -j --threads <int=0>      Run batches and enumerations on "
+              "<int> threads"
+           << endl;
+      cout << "                            (0 => one per core)." << endl;
       cout << "  -l --list_builtins        List the builtin rule tables."
            << endl;
       cout << "  -v --verbose              Print all digits of the final "
@@ -133,6 +268,70 @@ int main(int argc, char* argv[]) {
              << "), must be in the range [1, 60]." << endl;
         return -1;
       }
+    } else if (arg_parser.accept({"-w", "--window"})) {
+      if (!arg_parser.expect(&proof_options.window_radius)) return -1;
+      if (proof_options.window_radius < 0) {
+        cerr << "Invalid window_radius (" << proof_options.window_radius
+             << "), must be non-negative." << endl;
+        return -1;
+      }
+    } else if (arg_parser.accept({"-n", "--nested"})) {
+      proof_options.nested_proofs = true;
+    } else if (arg_parser.accept({"-a", "--anchors"})) {
+      std::string anchors;
+      if (!arg_parser.expect(&anchors)) return -1;
+      for (size_t i = 0; i < anchors.size(); ++i) {
+        char c = anchors[i];
+        if (c == 'e') {
+          proof_options.history_anchors |= ANCHOR_TAPE_END;
+        } else if (c == 's') {
+          proof_options.history_anchors |= ANCHOR_SPAN_CHANGE;
+        } else if ('A' <= c && c < 'A' + STATE_HALT && i + 1 < anchors.size() &&
+                   (anchors[i + 1] == '<' || anchors[i + 1] == '>')) {
+          proof_options.history_anchors |= ANCHOR_STATE;
+          proof_options.anchor_state = c - 'A';
+          proof_options.anchor_moving_right = anchors[++i] == '>';
+        } else {
+          cerr << "Invalid anchors (" << anchors << ")." << endl;
+          return -1;
+        }
+      }
+    } else if (arg_parser.accept({"-f", "--fixed_schedule"})) {
+      proof_options.adaptive_schedule = false;
+    } else if (arg_parser.accept({"-p", "--pipelined"})) {
+      proof_options.pipelined = true;
+    } else if (arg_parser.accept({"-r", "--load_patterns"})) {
+      if (!arg_parser.expect(&options.load_patterns_path)) return -1;
+    } else if (arg_parser.accept({"-s", "--save_patterns"})) {
+      if (!arg_parser.expect(&options.save_patterns_path)) return -1;
+    } else if (arg_parser.accept({"-P", "--pipeline"})) {
+      if (!arg_parser.expect(&pipeline_stages)) return -1;
+    } else if (arg_parser.accept({"--max_steps"})) {
+      if (!arg_parser.expect(&options.max_num_steps)) return -1;
+    } else if (arg_parser.accept({"--max_spans"})) {
+      uint64_t max_num_spans;
+      if (!arg_parser.expect(&max_num_spans)) return -1;
+      options.max_num_spans = max_num_spans;
+    } else if (arg_parser.accept({"--max_seconds"})) {
+      if (!arg_parser.expect(&options.max_seconds)) return -1;
+    } else if (arg_parser.accept({"-i", "--batch"})) {
+      if (!arg_parser.expect(&batch_path)) return -1;
+    } else if (arg_parser.accept({"-e", "--enumerate"})) {
+      if (!arg_parser.expect(&enumerate_num_states)) return -1;
+      if (enumerate_num_states < 1 || enumerate_num_states > 6) {
+        cerr << "Invalid no. states to enumerate (" << enumerate_num_states
+             << "), must be in the range [1, 6]." << endl;
+        return -1;
+      }
+    } else if (arg_parser.accept({"--tnf_steps"})) {
+      if (!arg_parser.expect(&tnf_max_num_steps)) return -1;
+    } else if (arg_parser.accept({"-j", "--threads"})) {
+      if (!arg_parser.expect(&num_threads)) return -1;
+      if (num_threads < 0) {
+        cerr << "Invalid no. threads (" << num_threads
+             << "), must be non-negative." << endl;
+        return -1;
+      }
     } else if (arg_parser.accept({"-b", "--builtin"})) {
       if (!arg_parser.expect(&builtin_rule_table_code)) return -1;
     } else if (arg_parser.accept({"-l", "--list_builtins"})) {
@@ -157,6 +356,99 @@ int main(int argc, char* argv[]) {
     return 0;
   }
 
+  if (macro_nbit == -1) {
+    macro_nbit = enumerate_num_states || !batch_path.empty()
+                     ? DEFAULT_MANY_MACRO_NBIT
+                     : DEFAULT_MACRO_NBIT;
+  }
+
+  if (enumerate_num_states) {
+    if (!batch_path.empty() || !builtin_rule_table_code.empty() ||
+        !rule_table_str.empty()) {
+      cerr << "Cannot specify both --enumerate and other machines" << endl;
+      return -1;
+    }
+    if (!options.save_patterns_path.empty()) {
+      cerr << "Cannot specify both --enumerate and --save_patterns" << endl;
+      return -1;
+    }
+    if (!options.load_patterns_path.empty()) {
+      cerr << "Cannot specify both --enumerate and --load_patterns" << endl;
+      return -1;
+    }
+    if (pipeline_stages.empty()) pipeline_stages = DEFAULT_TNF_PIPELINE_STAGES;
+    // Machines that are not decided otherwise would run forever.
+    if (std::isinf(options.max_seconds)) options.max_seconds = 1;
+    std::unique_ptr<TnfEnumerator> enumerator;
+    try {
+      enumerator.reset(new TnfEnumerator(enumerate_num_states, pipeline_stages,
+                                         macro_nbit, options,
+                                         tnf_max_num_steps, num_threads));
+    } catch (const std::runtime_error& e) {
+      cerr << "Invalid pipeline: " << e.what() << endl;
+      return -1;
+    }
+    TnfResult result = enumerator->run();
+    for (const std::string& rule_table : result.incomplete) {
+      cout << rule_table << endl;
+    }
+    enumerator->print_stats(cout);
+    cout << result.num_halted << " halting, " << result.num_nonhalting
+         << " nonhalting and " << result.num_incomplete
+         << " undecided machines" << endl;
+    if (result.num_unexpanded) {
+      cout << "Warning: The children of " << result.num_unexpanded
+           << " machines that halted after too many steps were not "
+              "enumerated"
+           << endl;
+    }
+    cout << "Most ones:  " << ConcisePrintBigNum(result.max_num_ones) << " ("
+         << result.max_ones_rule_table << ")" << endl;
+    cout << "Most steps: " << ConcisePrintBigNum(result.max_num_steps) << " ("
+         << result.max_steps_rule_table << ")" << endl;
+    return 0;
+  }
+
+  if (!batch_path.empty()) {
+    if (!builtin_rule_table_code.empty() || !rule_table_str.empty()) {
+      cerr << "Cannot specify both --batch and a rule table" << endl;
+      return -1;
+    }
+    if (!options.save_patterns_path.empty()) {
+      cerr << "Cannot specify both --batch and --save_patterns" << endl;
+      return -1;
+    }
+    if (!options.load_patterns_path.empty()) {
+      cerr << "Cannot specify both --batch and --load_patterns" << endl;
+      return -1;
+    }
+    if (pipeline_stages.empty()) {
+      pipeline_stages = DEFAULT_BATCH_PIPELINE_STAGES;
+    }
+    // One machine that is not decided otherwise would stall the batch.
+    if (std::isinf(options.max_seconds)) options.max_seconds = 1;
+    std::unique_ptr<BatchRunner> batch_runner;
+    try {
+      batch_runner.reset(new BatchRunner(pipeline_stages, macro_nbit, options,
+                                         num_threads));
+    } catch (const std::runtime_error& e) {
+      cerr << "Invalid pipeline: " << e.what() << endl;
+      return -1;
+    }
+    std::ifstream file;
+    if (batch_path != "-") {
+      file.open(batch_path);
+      if (!file) {
+        cerr << "Cannot open batch file " << batch_path << endl;
+        return -1;
+      }
+    }
+    batch_runner->run(batch_path == "-" ? std::cin : file, cout);
+    // The results on stdout are kept machine-readable.
+    batch_runner->print_stats(cerr);
+    return 0;
+  }
+
   const std::map<std::string, RuleTable> builtin_rule_tables = {
       {"bb1", best1},          {"bb2", best2},          {"bb3", best3},
       {"bb4", best4},          {"bb5", best5},          {"bb6", best6},
@@ -210,7 +502,33 @@ int main(int argc, char* argv[]) {
 
   cout << rule_table << endl;
 
-  TMResult result = run_turing_machine(rule_table, macro_nbit);
+  // Patterns are only loaded and saved by the proof stage, so no other stage
+  // may decide the machine first.
+  const bool use_pattern_store = !options.load_patterns_path.empty() ||
+                                 !options.save_patterns_path.empty();
+  if (pipeline_stages.empty()) {
+    pipeline_stages = use_pattern_store ? "proof" : DEFAULT_PIPELINE_STAGES;
+  } else if (use_pattern_store && pipeline_stages != "proof") {
+    cerr << "Cannot specify --load_patterns or --save_patterns with a "
+            "pipeline other than 'proof'"
+         << endl;
+    return -1;
+  }
+  std::unique_ptr<DeciderPipeline> pipeline;
+  try {
+    pipeline.reset(new DeciderPipeline(pipeline_stages, macro_nbit, options));
+  } catch (const std::runtime_error& e) {
+    cerr << "Invalid pipeline: " << e.what() << endl;
+    return -1;
+  }
+  TMResult result;
+  try {
+    result = pipeline->run(rule_table);
+  } catch (const std::runtime_error& e) {
+    cerr << "Invalid pattern store: " << e.what() << endl;
+    return -1;
+  }
+  pipeline->print_stats(cout);
   if (result.state == STATE_INCOMPLETE) {
     cout << "Program execution did not complete" << endl;
   } else if (result.state == STATE_NOHALT) {
@@ -47,6 +47,14 @@ struct HashSituation {
 
 }  // namespace
 
+MicroMachine::MicroMachine(const MicroMachine& parent,
+                           const RuleTable& rule_table)
+    : rule_table_(rule_table), macro_nbit_(parent.macro_nbit_) {
+  for (const auto& item : parent._cache) {
+    if (item.second.first.state != STATE_HALT) _cache.insert(item);
+  }
+}
+
 int64_t MicroMachine::step(MicroMachineState* mstate) const {
   auto cache_iter = _cache.find(*mstate);
   if (cache_iter != _cache.end()) {
@@ -83,3 +91,22 @@ int64_t MicroMachine::step(MicroMachineState* mstate) const {
   *mstate = result;
   return num_steps;
 }
+
+int MicroMachine::undefined_rule(MicroMachineState mstate) const {
+  // The halting rule is not cached, so the steps are simulated again.
+  typedef NBitArray<1, MacroSym> MicroTape;
+  uint state = mstate.state;
+  MicroTape tape = mstate.symbol;
+  int pos = mstate.move_right ? 0 : macro_nbit_ - 1;
+  while (true) {
+    bool symbol = tape[pos];
+    Rule rule = rule_table_(symbol, state);
+    if (rule.state == STATE_HALT) {
+      return rule_table_.is_undefined(symbol, state) ? 2 * state + symbol : -1;
+    }
+    state = rule.state;
+    tape[pos] = rule.symbol;
+    pos += rule.move_right ? 1 : -1;
+    assert(pos >= 0 && pos < macro_nbit_);
+  }
+}
@@ -81,9 +81,19 @@ class MicroMachine {
       : rule_table_(rule_table), macro_nbit_(macro_nbit) {
     assert(macro_nbit_ <= MAX_MACRO_NBIT);
   }
+  // Forks parent for a rule table that defines rules that were undefined in
+  // parent's, keeping the cached results that did not halt (which cannot
+  // have reached an undefined rule).
+  MicroMachine(const MicroMachine& parent, const RuleTable& rule_table);
 
   // Updates *mstate and returns the number of micro steps that were taken.
   int64_t step(MicroMachineState* mstate) const;
+  // Given an mstate that step() halts from, returns 2 * state + symbol for the
+  // undefined rule that it halted on (see RuleTable), or -1 if it halted on a
+  // defined rule.
+  int undefined_rule(MicroMachineState mstate) const;
+
+  size_t num_cached_steps() const { return _cache.size(); }
 
  private:
   RuleTable rule_table_;
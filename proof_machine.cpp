@@ -28,11 +28,203 @@
 
 #include "proof_machine.hpp"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 using std::cerr;
 using std::cout;
 using std::endl;
 
+namespace {
+
+// Binary serialization of integers (little-endian, fixed width) and BigNums
+// (a header of twice the no. bytes plus the sign bit, then the magnitude's
+// bytes from least to most significant).
+void write_uint(std::ostream& os, uint64_t value) {
+  char bytes[8];
+  for (int i = 0; i < 8; ++i) bytes[i] = (char)(value >> (8 * i));
+  os.write(bytes, sizeof(bytes));
+}
+
+uint64_t read_uint(std::istream& is) {
+  unsigned char bytes[8];
+  if (!is.read((char*)bytes, sizeof(bytes))) {
+    throw std::runtime_error("Unexpected end of pattern store");
+  }
+  uint64_t value = 0;
+  for (int i = 0; i < 8; ++i) value |= (uint64_t)bytes[i] << (8 * i);
+  return value;
+}
+
+void write_bignum(std::ostream& os, const BigNum& value) {
+  size_t max_num_bytes = (mpz_sizeinbase(value.get_mpz_t(), 2) + 7) / 8;
+  std::vector<char> bytes(max_num_bytes);
+  size_t num_bytes;
+  mpz_export(bytes.data(), &num_bytes, -1, 1, 0, 0, value.get_mpz_t());
+  write_uint(os, num_bytes * 2 + (value < 0));
+  os.write(bytes.data(), num_bytes);
+}
+
+BigNum read_bignum(std::istream& is) {
+  // Guards against allocating absurd amounts for malformed stores.
+  enum : uint64_t { MAX_NUM_BYTES = 1 << 30 };
+  uint64_t header = read_uint(is);
+  uint64_t num_bytes = header / 2;
+  if (num_bytes > MAX_NUM_BYTES) {
+    throw std::runtime_error("Invalid number in pattern store");
+  }
+  std::vector<char> bytes(num_bytes);
+  if (!is.read(bytes.data(), num_bytes)) {
+    throw std::runtime_error("Unexpected end of pattern store");
+  }
+  BigNum value;
+  mpz_import(value.get_mpz_t(), num_bytes, -1, 1, 0, 0, bytes.data());
+  if (header % 2) value = -value;
+  return value;
+}
+
+void write_string(std::ostream& os, const std::string& str) {
+  write_uint(os, str.size());
+  os.write(str.data(), str.size());
+}
+
+std::string read_string(std::istream& is) {
+  enum : uint64_t { MAX_SIZE = 1 << 16 };
+  uint64_t size = read_uint(is);
+  if (size > MAX_SIZE) {
+    throw std::runtime_error("Invalid string in pattern store");
+  }
+  std::string str(size, '\0');
+  if (!is.read(&str[0], size)) {
+    throw std::runtime_error("Unexpected end of pattern store");
+  }
+  return str;
+}
+
+}  // namespace
+
+PatternWindow::PatternWindow(const MacroMachineState& mstate, int radius)
+    : first(mstate.tape.begin()),
+      last(mstate.tape.end()),
+      left_fence(mstate.tape.end()),
+      right_fence(mstate.tape.end()),
+      tape_end(mstate.tape.end()),
+      num_spans(mstate.tape.size()),
+      head_offset(mstate.cur_span_idx) {
+  if (!radius) return;
+  const Tape& tape = mstate.tape;
+  first = mstate.cur_span;
+  head_offset = 0;
+  while (head_offset < radius && first != tape.begin()) {
+    --first;
+    ++head_offset;
+  }
+  left_fence = first != tape.begin() ? std::prev(first) : tape_end;
+  last = std::next(Tape::const_iterator(mstate.cur_span));
+  num_spans = head_offset + 1;
+  for (int i = 0; i < radius && last != tape_end; ++i) {
+    ++last;
+    ++num_spans;
+  }
+  right_fence = last;
+}
+
+size_t PatternKey::window_hash(const MacroMachineState& mstate,
+                               int window_radius) {
+  using detail::hash_combine;
+  PatternWindow window(mstate, window_radius);
+  // Same as MacroMachineState::symbols_hash, but only over the key spans.
+  uint64_t symbols_hash = 0;
+  auto span = window.key_begin();
+  for (auto next_span = std::next(span); next_span != window.key_end();
+       span = next_span++) {
+    symbols_hash += symbol_pair_hash(span->symbol, next_span->symbol);
+  }
+  return hash_combine(mstate.state, symbols_hash, window.num_key_spans(),
+                      window.key_head_offset(), mstate.moving_right);
+}
+
+size_t PatternKey::compute_hash() const {
+  using detail::hash_combine;
+  // Same as window_hash (and MacroMachineState::symbols_hash for whole-tape
+  // keys, whose symbols are those of every span).
+  uint64_t symbols_hash = 0;
+  for (size_t i = 0; i + 1 < symbols().size(); ++i) {
+    symbols_hash += symbol_pair_hash(symbols()[i], symbols()[i + 1]);
+  }
+  return hash_combine(state(), symbols_hash, (int)symbols().size(),
+                      (int)cur_span_idx(), moving_right());
+}
+
+void PatternKey::write(std::ostream& os) const {
+  write_uint(os, state());
+  write_uint(os, symbols().size());
+  for (MacroSym symbol : symbols()) write_uint(os, symbol);
+  write_uint(os, cur_span_idx());
+  write_uint(os, moving_right());
+}
+
+void PatternKey::read(std::istream& is) {
+  std::get<0>(*this) = read_uint(is);
+  enum : uint64_t { MAX_NUM_SYMBOLS = 1 << 24 };
+  uint64_t num_symbols = read_uint(is);
+  if (num_symbols > MAX_NUM_SYMBOLS) {
+    throw std::runtime_error("Invalid key in pattern store");
+  }
+  std::vector<MacroSym>& symbols = std::get<1>(*this);
+  symbols.resize(num_symbols);
+  for (MacroSym& symbol : symbols) symbol = read_uint(is);
+  std::get<2>(*this) = read_uint(is);
+  std::get<3>(*this) = read_uint(is);
+  if (state() >= STATE_HALT || cur_span_idx() >= symbols.size()) {
+    throw std::runtime_error("Invalid key in pattern store");
+  }
+  hash_ = compute_hash();
+}
+
+BigNum affine_sequence_sums(const BigNum& x0, const BigNum& a, const BigNum& b,
+                            const BigNum& n, BigNum* sum1, BigNum* sum2) {
+  if (a == 1) {
+    BigNum t1 = n * (n - 1) / 2;                // Sum of k.
+    BigNum t2 = (n - 1) * n * (2 * n - 1) / 6;  // Sum of k^2.
+    *sum1 = n * x0 + b * t1;
+    *sum2 = n * x0 * x0 + 2 * x0 * b * t1 + b * b * t2;
+    return x0 + b * n;
+  }
+  // With g1 and g2 the sums of a^k and a^2k, x_k = a^k x0 + b (a^k - 1)/(a - 1)
+  // gives the sums below, where each division is exact.
+  BigNum an;
+  mpz_pow_ui(an.get_mpz_t(), a.get_mpz_t(), n.get_ui());
+  BigNum g1 = (an - 1) / (a - 1);
+  BigNum g2 = (an * an - 1) / (a * a - 1);
+  *sum1 = x0 * g1 + b * ((g1 - n) / (a - 1));
+  *sum2 = x0 * x0 * g2 + 2 * x0 * b * ((g2 - g1) / (a - 1)) +
+          b * b * ((g2 - 2 * g1 + n) / ((a - 1) * (a - 1)));
+  return an * x0 + b * g1;
+}
+
+namespace {
+
+// Predicts the no. times a pattern confirmed at instance could be applied
+// (before its span size lower bounds are known), or returns -1 if it never
+// shrinks.
+BigNum predict_num_times_applicable(const Pattern& pattern,
+                                    const PatternInstance& instance) {
+  BigNum num_times = -1;
+  for (size_t i = 0; i < pattern.num_spans(); ++i) {
+    BigNum delta = pattern.span_size_delta(i);
+    if (delta >= 0) continue;
+    BigNum span_num_times = instance.span_size(i) / -delta;
+    if (num_times == -1 || span_num_times < num_times) {
+      num_times = span_num_times;
+    }
+  }
+  return num_times;
+}
+
+}  // namespace
+
 std::ostream& operator<<(std::ostream& os, const PatternKey& key) {
   os << state_char(key.state()) << ": ";
   const char* const sep = "|";
@@ -47,53 +239,132 @@ std::ostream& operator<<(std::ostream& os, const PatternKey& key) {
   return os;
 }
 
-BigNum Pattern::num_times_applicable(const MacroMachineState& mstate) const {
-  BigNum min_num_times = -1;
-  int64_t span_idx = 0;
-  for (const TapeSpan& span : mstate.tape) {
-    const auto& lbound_and_delta = lbounds_and_deltas_[span_idx++];
-    if (lbound_and_delta.second == 0) {
-      // Fixed spans must not change in size.
-      if (span.size != lbound_and_delta.first) return 0;
-    } else if (lbound_and_delta.second < 0) {
-      // Shrinking spans must meet or exceed the lower bound.
-      if (span.size < lbound_and_delta.first) return 0;
-      BigNum num_times =
-          1 + (span.size - lbound_and_delta.first) / -lbound_and_delta.second;
-      if (min_num_times == -1 || num_times < min_num_times) {
-        min_num_times = num_times;
+void Pattern::num_times_applicable(const MacroMachineState& mstate,
+                                   BigNum* num_times, Scratch* scratch) const {
+  Tape::const_iterator first_span =
+      std::prev(Tape::const_iterator(mstate.cur_span), head_offset_);
+  // The spans are checked first, so that patterns that cannot be applied are
+  // rejected early.
+  Tape::const_iterator span = first_span;
+  for (size_t span_idx = 0; span_idx < num_spans(); ++span_idx) {
+    const auto& lbound_and_delta = lbounds_and_deltas_[span_idx];
+    const BigNum& span_size = (span++)->size;
+    // Fixed spans must not change in size, and the others (the driver, and
+    // growing spans when reusing a pattern proven at a different time) must
+    // meet or exceed the lower bound.
+    bool fixed =
+        (int)span_idx != driver_.span_idx && lbound_and_delta.second == 0;
+    if (fixed ? span_size != lbound_and_delta.first
+              : span_size < lbound_and_delta.first) {
+      *num_times = 0;
+      return;
+    }
+  }
+  BigNum& min_num_times = *num_times;
+  min_num_times = -1;
+  // A span of size s >= lower_bound that shrinks by -delta each round can be
+  // consumed 1 + (s - lower_bound) / -delta times.
+  BigNum& span_num_times = scratch->span_num_times;
+  auto update_min_num_times = [&](const BigNum& span_size,
+                                  const std::pair<BigNum, BigNum>&
+                                      lbound_and_delta) {
+    span_num_times = span_size - lbound_and_delta.first;
+    span_num_times /= lbound_and_delta.second;
+    span_num_times = 1 - span_num_times;
+    if (min_num_times == -1 || span_num_times < min_num_times) {
+      min_num_times = span_num_times;
+    }
+  };
+  span = first_span;
+  for (size_t span_idx = 0; span_idx < num_spans(); ++span_idx) {
+    const auto& lbound_and_delta = lbounds_and_deltas_[span_idx];
+    const BigNum& span_size = (span++)->size;
+    if ((int)span_idx == driver_.span_idx) {
+      // The driver shrinks if (a - 1) * x + b < 0. It then shrinks faster and
+      // faster unless a is 1.
+      if (driver_.multiplier == 1) {
+        if (lbound_and_delta.second < 0) {
+          update_min_num_times(span_size, lbound_and_delta);
+        }
+        continue;
+      }
+      span_num_times = lbound_and_delta.second - span_size;
+      add_product(&span_num_times, driver_.multiplier, span_size);
+      if (span_num_times < 0 && (min_num_times == -1 || min_num_times > 1)) {
+        min_num_times = 1;
       }
+    } else if (lbound_and_delta.second < 0) {
+      update_min_num_times(span_size, lbound_and_delta);
     }
   }
-  return min_num_times;
+  if (has_driver() && driver_.multiplier > 1 &&
+      min_num_times > MAX_GEOMETRIC_DRIVER_ROUNDS) {
+    min_num_times = MAX_GEOMETRIC_DRIVER_ROUNDS;
+  }
 }
 
 BigNum Pattern::apply(MacroMachineState* mstate, BigNum* num_micro_steps,
                       BigNum* num_macro_steps, BigNum* num_iters) const {
-  assert((size_t)mstate->tape.size() == lbounds_and_deltas_.size());
-  BigNum num_times = num_times_applicable(*mstate);
+  BigNum num_times;
+  Scratch scratch;
+  num_times_applicable(*mstate, &num_times, &scratch);
   if (num_times == 0) return 0;
-  *num_micro_steps += num_micro_steps_ * num_times;
-  int64_t span_idx = 0;
-  for (TapeSpan& span : mstate->tape) {
+  apply(mstate, num_times, num_micro_steps, num_macro_steps, num_iters,
+        &scratch);
+  return num_times;
+}
+
+void Pattern::apply(MacroMachineState* mstate, const BigNum& num_times,
+                    BigNum* num_micro_steps, BigNum* num_macro_steps,
+                    BigNum* num_iters, Scratch* scratch) const {
+  BigNum& sum_m_s0 = scratch->sum_m_s0;
+  BigNum& sum_m_delta = scratch->sum_m_delta;
+  BigNum& sum_c = scratch->sum_c;
+  sum_m_s0 = 0;
+  sum_m_delta = 0;
+  sum_c = num_micro_steps_;
+  Tape::iterator span = std::prev(mstate->cur_span, head_offset_);
+  for (size_t span_idx = 0; span_idx < num_spans(); ++span_idx) {
     const auto& lbound_and_delta = lbounds_and_deltas_[span_idx];
-    // TODO: Try to clean this up a bit.
+    if ((int)span_idx == driver_.span_idx) {
+      BigNum sum1, sum2;
+      span->size = affine_sequence_sums(span->size, driver_.multiplier,
+                                        lbound_and_delta.second, num_times,
+                                        &sum1, &sum2);
+      const BigNum* x2 = driver_.num_micro_steps_x2;
+      *num_micro_steps += (x2[2] * sum2 + x2[1] * sum1 + x2[0] * num_times) / 2;
+      *num_macro_steps += driver_.num_macro_steps_per_symbol * sum1;
+      *num_iters += driver_.num_iters_per_symbol * sum1;
+      ++span;
+      continue;
+    }
+    // A span of size s that changes by delta each round takes m * s + c micro
+    // steps per round, so over n rounds it takes
+    //   n * (m * s0 + c) + m * delta * n * (n - 1) / 2.
+    // The terms are summed over the spans before multiplying by n, so that
+    // there is only one product of two huge numbers (rather than one per span).
     const BigNum& m = span_num_micro_steps_[span_idx].first;
-    const BigNum& c = span_num_micro_steps_[span_idx].second;
-    const BigNum& s0 = span.size;
     const BigNum& delta = lbound_and_delta.second;
-    BigNum s1 = s0 + delta * (num_times - 1);
-    if (abs(delta) > 0) {
-      BigNum x = num_times * (s0 + s1) / 2;
-      *num_micro_steps += m * x;
+    if (delta != 0) {
+      add_product(&sum_m_s0, m, span->size);
+      add_product(&sum_m_delta, m, delta);
+      add_product(&span->size, delta, num_times);
     }
-    *num_micro_steps += c * num_times;
-    span.size += delta * num_times;
-    span_idx++;
+    sum_c += span_num_micro_steps_[span_idx].second;
+    ++span;
   }
-  *num_macro_steps += num_macro_steps_ * num_times;
-  *num_iters += num_iters_ * num_times;
-  return num_times;
+  // Note: The sums are reused as temporaries. The product is accumulated into
+  // one (rather than assigned to it), which grows its storage without
+  // allocating anew.
+  sum_m_s0 += sum_c;
+  add_product(num_micro_steps, num_times, sum_m_s0);
+  sum_c = num_times - 1;
+  sum_m_s0 = 0;
+  add_product(&sum_m_s0, sum_c, num_times);
+  sum_m_s0 /= 2;
+  add_product(num_micro_steps, sum_m_delta, sum_m_s0);
+  add_product(num_macro_steps, num_macro_steps_, num_times);
+  add_product(num_iters, num_iters_, num_times);
 }
 
 std::ostream& operator<<(std::ostream& os, const Pattern& pattern) {
@@ -102,7 +373,11 @@ std::ostream& operator<<(std::ostream& os, const Pattern& pattern) {
   // Note: Skips first and last "infinite" spans.
   for (int i = 1; i < (int)pattern.lbounds_and_deltas_.size() - 1; ++i) {
     const auto& lbound_and_delta = pattern.lbounds_and_deltas_[i];
-    if (lbound_and_delta.second == 0) {
+    if (i == pattern.driver_.span_idx) {
+      os << "*" << pattern.driver_.multiplier
+         << (lbound_and_delta.second >= 0 ? "+" : "")
+         << lbound_and_delta.second << "(>=" << lbound_and_delta.first << ")";
+    } else if (lbound_and_delta.second == 0) {
       os << lbound_and_delta.first;
     } else if (lbound_and_delta.second > 0) {
       os << "+" << lbound_and_delta.second;
@@ -114,11 +389,81 @@ std::ostream& operator<<(std::ostream& os, const Pattern& pattern) {
   return os;
 }
 
+void Pattern::write(std::ostream& os) const {
+  write_uint(os, num_spans());
+  for (const auto& lbound_and_delta : lbounds_and_deltas_) {
+    write_bignum(os, lbound_and_delta.first);
+    write_bignum(os, lbound_and_delta.second);
+  }
+  write_uint(os, head_offset_);
+  write_uint(os, num_steps_);
+  write_uint(os, depth_);
+  write_bignum(os, num_micro_steps_);
+  write_bignum(os, num_macro_steps_);
+  write_bignum(os, num_iters_);
+  write_uint(os, span_num_micro_steps_.size());
+  for (const auto& span_num_micro_steps : span_num_micro_steps_) {
+    write_bignum(os, span_num_micro_steps.first);
+    write_bignum(os, span_num_micro_steps.second);
+  }
+  write_uint(os, driver_.span_idx);
+  if (has_driver()) {
+    write_bignum(os, driver_.multiplier);
+    for (const BigNum& coef : driver_.num_micro_steps_x2) {
+      write_bignum(os, coef);
+    }
+    write_bignum(os, driver_.num_macro_steps_per_symbol);
+    write_bignum(os, driver_.num_iters_per_symbol);
+  }
+}
+
+void Pattern::read(std::istream& is) {
+  enum : uint64_t { MAX_NUM_SPANS = 1 << 24 };
+  uint64_t num_spans = read_uint(is);
+  if (num_spans > MAX_NUM_SPANS) {
+    throw std::runtime_error("Invalid pattern in pattern store");
+  }
+  lbounds_and_deltas_.resize(num_spans);
+  for (auto& lbound_and_delta : lbounds_and_deltas_) {
+    lbound_and_delta.first = read_bignum(is);
+    lbound_and_delta.second = read_bignum(is);
+  }
+  head_offset_ = read_uint(is);
+  num_steps_ = read_uint(is);
+  depth_ = read_uint(is);
+  num_micro_steps_ = read_bignum(is);
+  num_macro_steps_ = read_bignum(is);
+  num_iters_ = read_bignum(is);
+  uint64_t num_span_num_micro_steps = read_uint(is);
+  if (num_span_num_micro_steps != 0 && num_span_num_micro_steps != num_spans) {
+    throw std::runtime_error("Invalid pattern in pattern store");
+  }
+  span_num_micro_steps_.resize(num_span_num_micro_steps);
+  for (auto& span_num_micro_steps : span_num_micro_steps_) {
+    span_num_micro_steps.first = read_bignum(is);
+    span_num_micro_steps.second = read_bignum(is);
+  }
+  driver_.span_idx = read_uint(is);
+  if (has_driver()) {
+    driver_.multiplier = read_bignum(is);
+    for (BigNum& coef : driver_.num_micro_steps_x2) coef = read_bignum(is);
+    driver_.num_macro_steps_per_symbol = read_bignum(is);
+    driver_.num_iters_per_symbol = read_bignum(is);
+  }
+  if (head_offset_ < 0 || (uint64_t)head_offset_ >= num_spans ||
+      driver_.span_idx < -1 || driver_.span_idx >= (int64_t)num_spans ||
+      span_num_micro_steps_.size() != num_spans) {
+    throw std::runtime_error("Invalid pattern in pattern store");
+  }
+}
+
 bool PatternInstance::confirm_pattern(const PatternInstance& later_instance,
-                                      Pattern* pattern, bool* nohalt) const {
+                                      bool allow_respawn, Pattern* pattern,
+                                      bool* nohalt) const {
   assert(later_instance.num_spans() == num_spans());
-  std::vector<std::pair<BigNum, BigNum>> lbounds_and_deltas;
-  lbounds_and_deltas.reserve(num_spans());
+  assert(later_instance.head_offset_ == head_offset_);
+  pattern->assign(num_spans(), head_offset_,
+                  later_instance.step_num_ - step_num_);
   bool any_decreasing = false;
   for (size_t i = 0; i < num_spans(); ++i) {
     // Note: The IDs matching means the span's size never reached 0
@@ -129,71 +474,670 @@ bool PatternInstance::confirm_pattern(const PatternInstance& later_instance,
     // don't reach 0 (and get erased).
     if (later_instance.span_id(i) != span_id(i) &&
         later_instance.span_size(i) != span_size(i)) {
-      return false;
+      if (!allow_respawn) return false;
+      allow_respawn = false;
     }
-    const BigNum& size_lbound = span_size(i);
     BigNum size_delta = later_instance.span_size(i) - span_size(i);
-    lbounds_and_deltas.emplace_back(size_lbound, size_delta);
+    pattern->update_span_size_lower_bound(i, span_size(i));
     if (size_delta < 0) {
       any_decreasing = true;
     }
+    pattern->update_span_size_delta(i, size_delta);
   }
   *nohalt = !any_decreasing;  // Indicates pattern does not shrink with time.
-  BigNum num_micro_steps = later_instance.micro_step_num_ - micro_step_num_;
-  BigNum num_macro_steps = later_instance.macro_pos_ - macro_pos_;
-  BigNum num_iters = later_instance.iter_num_ - iter_num_;
-  *pattern =
-      Pattern(lbounds_and_deltas, num_micro_steps, num_macro_steps, num_iters);
+  pattern->update_num_micro_steps(later_instance.micro_step_num_.get() -
+                                  micro_step_num_.get());
+  pattern->update_num_macro_steps(later_instance.macro_pos_.get() -
+                                  macro_pos_.get());
+  pattern->update_num_iters(later_instance.iter_num_.get() - iter_num_.get());
   return true;
 }
 
 std::ostream& operator<<(std::ostream& os, const PatternInstance& inst) {
-  os << "iter_num=" << inst.iter_num_ << " ";
+  os << "iter_num=" << inst.iter_num() << " ";
   os << "|";
   // Note: Skips first and last "infinite" spans.
-  for (int i = 1; i < (int)inst.span_sizes_and_ids_.size() - 1; ++i) {
-    const auto& size_and_id = inst.span_sizes_and_ids_[i];
-    os << "@" << size_and_id.second << "*" << size_and_id.first;
+  for (int i = 1; i < (int)inst.num_spans() - 1; ++i) {
+    os << "@" << inst.span_id(i) << "*" << inst.span_size(i);
     os << "|";
   }
   return os;
 }
 
-BigNum ProofMachine::step_with_potential_pattern(
-    Pattern* pattern, const PatternInstance& current_instance,
-    MacroMachineState* mstate, BigNum* num_micro_steps, BigNum* macro_pos,
-    BigNum* num_iters) const {
+void RoundTracker::start(const PatternWindow& window, uint64_t step_num) {
+  active_ = true;
+  start_step_num_ = step_num;
+  num_spans_ = window.num_spans;
+  if ((int)span_info_.size() < num_spans_) {
+    span_info_.resize(num_spans_);
+    span_idxs_by_id_.resize(num_spans_);
+  }
+  int span_idx = 0;
+  for (auto span = window.first; span != window.last; ++span, ++span_idx) {
+    SpanInfo& span_info = span_info_[span_idx];
+    span_info.size0 = span->size;
+    span_info.min_size = span->size;
+    span_info.num_micro_steps_per_symbol = 0;
+    span_info.num_micro_steps_offset = 0;
+    span_idxs_by_id_[span_idx] = std::make_pair(span->id, span_idx);
+  }
+  std::sort(span_idxs_by_id_.begin(), span_idxs_by_id_.begin() + num_spans_);
+  has_left_fence_ = window.has_left_fence();
+  has_right_fence_ = window.has_right_fence();
+  if (has_left_fence_) {
+    left_fence_id_ = window.left_fence->id;
+    left_fence_size_ = window.left_fence->size;
+  }
+  if (has_right_fence_) {
+    right_fence_id_ = window.right_fence->id;
+    right_fence_size_ = window.right_fence->size;
+  }
+}
+
+RoundTracker::SpanInfo* RoundTracker::find_span_info(SpanID id) {
+  auto end = span_idxs_by_id_.begin() + num_spans_;
+  auto it = std::lower_bound(span_idxs_by_id_.begin(), end,
+                             std::make_pair(id, 0));
+  if (it == end || it->first != id) return nullptr;
+  return &span_info_[it->second];
+}
+
+void RoundTracker::track_macro_step(const MacroMachineState& mstate,
+                                    SpanID old_cur_span_id,
+                                    const BigNum& old_cur_span_size,
+                                    SpanID deleted_span_id,
+                                    Tape::iterator shrunk_span,
+                                    const BigNum& this_num_micro_steps,
+                                    bool did_jump) {
+  // The head must stay inside the window, and the fences must not be deleted.
+  // Note that deleted_span_id is 0 if no span was deleted, which is also the ID
+  // of the left end of the tape (which is never deleted).
+  SpanID cur_span_id = mstate.cur_span->id;
+  auto is_fence = [&](SpanID id) {
+    return (has_left_fence_ && id == left_fence_id_) ||
+           (has_right_fence_ && id == right_fence_id_);
+  };
+  if (is_fence(cur_span_id) || (deleted_span_id && is_fence(deleted_span_id))) {
+    active_ = false;
+    return;
+  }
+  // Note: A deleted span cannot be part of the pattern (its ID will not
+  // match), and if it is the one that shrunk then shrunk_span is invalid.
+  if (shrunk_span != mstate.tape.end() && !deleted_span_id) {
+    SpanInfo* span_info = find_span_info(shrunk_span->id);
+    if (span_info && shrunk_span->size < span_info->min_size) {
+      span_info->min_size = shrunk_span->size;
+    }
+  }
+  if (did_jump) {
+    SpanInfo* span_info = find_span_info(old_cur_span_id);
+    if (span_info) {
+      span_info->num_micro_steps_per_symbol += this_num_micro_steps;
+      BigNum& delta = num_micro_steps_offset_delta_;
+      delta = old_cur_span_size - span_info->size0;
+      delta *= this_num_micro_steps;
+      span_info->num_micro_steps_offset += delta;
+    }
+  }
+}
+
+bool RoundTracker::prove_pattern(const PatternInstance& start_instance,
+                                 const MacroMachineState& mstate,
+                                 int window_radius, Pattern* pattern) const {
+  PatternWindow window(mstate, window_radius);
+  if (window.has_left_fence() != has_left_fence_ ||
+      window.has_right_fence() != has_right_fence_ ||
+      (has_left_fence_ && (window.left_fence->id != left_fence_id_ ||
+                           window.left_fence->size != left_fence_size_)) ||
+      (has_right_fence_ && (window.right_fence->id != right_fence_id_ ||
+                            window.right_fence->size != right_fence_size_))) {
+    return false;
+  }
+  // As in ProofMachine::prove_pattern, the micro steps spent jumping over the
+  // spans that change from round to round are attributed to them, and the
+  // rest are constant.
+  BigNum num_micro_steps = pattern->num_micro_steps();
+  size_t span_idx = 0;
+  for (auto span = window.first; span != window.last; ++span, ++span_idx) {
+    if (pattern->span_size_delta(span_idx) == 0) continue;
+    // Note: This also rejects a respawned span (see confirm_pattern). The
+    // round started at start_instance, so the span's info is at its index.
+    if (span->id != start_instance.span_id(span_idx)) return false;
+    const SpanInfo& span_info = span_info_[span_idx];
+    pattern->update_span_size_lower_bound(
+        span_idx, span_info.size0 - span_info.min_size + 1);
+    pattern->update_span_num_micro_steps(span_idx,
+                                         span_info.num_micro_steps_per_symbol,
+                                         span_info.num_micro_steps_offset);
+    num_micro_steps -= span_info.num_micro_steps_per_symbol * span_info.size0 +
+                       span_info.num_micro_steps_offset;
+  }
+  pattern->update_num_micro_steps(num_micro_steps);
+  return true;
+}
+
+PatternCache::PatternCache(const PatternCache& other)
+    : capacity_(other.capacity_),
+      window_radius_(other.window_radius_),
+      entries_(other.entries_) {
+  for (const auto& item : other.index_) {
+    index_.emplace(item.first, entries_.rebind(item.second));
+  }
+}
+
+const Pattern* PatternCache::find(const MacroMachineState& mstate,
+                                  BigNum* num_times) {
+  auto range = index_.equal_range(PatternKey::hash(mstate, window_radius_));
+  list_type::iterator found_entry = entries_.end();
+  for (auto it = range.first; it != range.second; ++it) {
+    auto entry = it->second;
+    if ((found_entry == entries_.end() ||
+         entry->second.depth() > found_entry->second.depth()) &&
+        entry->first.matches(mstate)) {
+      // Note: Only patterns with a driver can be cached and later found to
+      // never shrink (-1), and they are left to be proven again (and found not
+      // to halt) instead.
+      entry->second.num_times_applicable(mstate, &entry_num_times_,
+                                         &pattern_scratch_);
+      if (entry_num_times_ > 0) {
+        found_entry = entry;
+        num_times->swap(entry_num_times_);
+      }
+    }
+  }
+  if (found_entry == entries_.end()) return nullptr;
+  entries_.splice(entries_.begin(), entries_, found_entry);
+  return &found_entry->second;
+}
+
+bool PatternCache::insert(const PatternKey& key, const Pattern& pattern) {
+  auto range = index_.equal_range(key.hash());
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->second.depth() == pattern.depth() &&
+        it->second->first == key) {
+      it->second->second = pattern;
+      entries_.splice(entries_.begin(), entries_, it->second);
+      return false;
+    }
+  }
+  if (!capacity_) return false;
+  bool evicted = false;
+  if ((size_t)entries_.size() >= capacity_) {
+    auto lru_entry = std::prev(entries_.end());
+    range = index_.equal_range(lru_entry->first.hash());
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == lru_entry) {
+        index_.erase(it);
+        break;
+      }
+    }
+    entries_.erase(lru_entry);
+    evicted = true;
+  }
+  entries_.emplace_front(key, pattern);
+  index_.emplace(key.hash(), entries_.begin());
+  return evicted;
+}
+
+void PatternCache::save(std::ostream& os) const {
+  write_uint(os, entries_.size());
+  for (auto entry = entries_.end(); entry != entries_.begin();) {
+    --entry;
+    entry->first.write(os);
+    entry->second.write(os);
+  }
+}
+
+size_t PatternCache::load(std::istream& is) {
+  uint64_t num_entries = read_uint(is);
+  std::vector<std::pair<PatternKey, Pattern>> entries;
+  for (uint64_t i = 0; i < num_entries; ++i) {
+    entries.emplace_back(PatternKey(window_radius_), Pattern());
+    PatternKey& key = entries.back().first;
+    Pattern& pattern = entries.back().second;
+    key.read(is);
+    pattern.read(is);
+    // The key's symbols are those of the pattern's spans plus any fences.
+    int num_left_fences = key.cur_span_idx() - pattern.head_offset();
+    int num_right_fences =
+        (int)key.symbols().size() - (int)pattern.num_spans() - num_left_fences;
+    if (num_left_fences < 0 || num_left_fences > 1 || num_right_fences < 0 ||
+        num_right_fences > 1 ||
+        (!window_radius_ && num_left_fences + num_right_fences)) {
+      throw std::runtime_error("Invalid pattern in pattern store");
+    }
+  }
+  for (const auto& entry : entries) insert(entry.first, entry.second);
+  return entries.size();
+}
+
+int64_t PatternHistoryMap::find(const MacroMachineState& mstate,
+                                size_t hash) const {
+  if (table_.empty()) return -1;
+  size_t mask = table_.size() - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask) {
+    uint32_t slot = table_[i];
+    if (slot == EMPTY_SLOT) return -1;
+    if (slot == ERASED_SLOT) continue;
+    const Entry& entry = entries_[slot - 1];
+    if (entry.key.hash() == hash && entry.key.matches(mstate)) {
+      return slot - 1;
+    }
+  }
+}
+
+void PatternHistoryMap::insert_slot(uint32_t entry_idx) {
+  size_t mask = table_.size() - 1;
+  for (size_t i = entries_[entry_idx].key.hash() & mask;; i = (i + 1) & mask) {
+    if (table_[i] == EMPTY_SLOT || table_[i] == ERASED_SLOT) {
+      num_used_slots_ += (table_[i] == EMPTY_SLOT);
+      table_[i] = entry_idx + 1;
+      return;
+    }
+  }
+}
+
+void PatternHistoryMap::erase_slot(uint32_t entry_idx) {
+  size_t mask = table_.size() - 1;
+  for (size_t i = entries_[entry_idx].key.hash() & mask;; i = (i + 1) & mask) {
+    assert(table_[i] != EMPTY_SLOT);
+    if (table_[i] == entry_idx + 1) {
+      table_[i] = ERASED_SLOT;
+      return;
+    }
+  }
+}
+
+void PatternHistoryMap::rehash(size_t table_size) {
+  table_.assign(table_size, EMPTY_SLOT);
+  num_used_slots_ = 0;
+  for (uint32_t entry_idx = 0; entry_idx < entries_.size(); ++entry_idx) {
+    insert_slot(entry_idx);
+  }
+}
+
+void PatternHistoryMap::reset(Entry* entry, size_t hash) {
+  entry->epoch = epoch_;
+  entry->history.num_instances = 0;
+  entry->history.key_hash = hash;
+  entry->history.instances.clear();
+}
+
+PatternHistory& PatternHistoryMap::operator[](const MacroMachineState& mstate) {
+  size_t hash = PatternKey::hash(mstate, window_radius_);
+  int64_t found_idx = find(mstate, hash);
+  if (found_idx != -1) {
+    Entry& entry = entries_[found_idx];
+    if (entry.epoch != epoch_) reset(&entry, hash);
+    return entry.history;
+  }
+  // Keep the load factor (including erased slots) <= 1/2, growing the table if
+  // the no. entries requires it.
+  if (2 * (num_used_slots_ + 1) > table_.size()) {
+    size_t table_size = 16;
+    while (4 * (entries_.size() + 1) > table_size) table_size *= 2;
+    rehash(table_size);
+  }
+  // Look for an entry from an earlier epoch to recycle.
+  for (int i = 0; i < MAX_RECYCLE_SCAN && !entries_.empty(); ++i) {
+    uint32_t entry_idx = recycle_cursor_;
+    recycle_cursor_ = (recycle_cursor_ + 1) % entries_.size();
+    Entry& entry = entries_[entry_idx];
+    if (entry.epoch != epoch_) {
+      erase_slot(entry_idx);
+      size_t key_capacity = entry.key.symbols().capacity();
+      entry.key.assign(mstate);
+      num_regrown_keys_ += entry.key.symbols().capacity() != key_capacity;
+      insert_slot(entry_idx);
+      reset(&entry, hash);
+      return entry.history;
+    }
+  }
+  entries_.emplace_back(mstate, window_radius_);
+  uint32_t entry_idx = entries_.size() - 1;
+  insert_slot(entry_idx);
+  reset(&entries_.back(), hash);
+  return entries_.back().history;
+}
+
+uint64_t ProofScheduler::threshold(size_t key_hash) const {
+  if (!adaptive_) return threshold_;
+  auto it = key_stats_.find(key_hash);
+  if (it == key_stats_.end()) return threshold_;
+  uint32_t shift = std::min<uint32_t>(it->second.num_failures_in_a_row,
+                                      MAX_BACKOFF_SHIFT);
+  return threshold_ + (uint64_t(1) << shift) - 1;
+}
+
+bool ProofScheduler::should_attempt(size_t key_hash, const BigNum& num_times,
+                                    const BigNum& num_iters) {
+  if (!adaptive_ || num_times == -1) return true;
+  // The payoff is weighted by the (smoothed) fraction of earlier attempts at
+  // this tape pattern that succeeded.
+  uint32_t num_attempts = 0;
+  uint32_t num_successes = 0;
+  auto it = key_stats_.find(key_hash);
+  if (it != key_stats_.end()) {
+    num_attempts = it->second.num_attempts;
+    num_successes = it->second.num_successes;
+  }
+  payoff_ = num_times * num_iters * (num_successes + 1);
+  if (payoff_ > avg_cost_iters_ * (num_attempts + 2)) return true;
+  ++num_skipped_;
+  return false;
+}
+
+void ProofScheduler::record_attempt(size_t key_hash, const BigNum& cost_iters,
+                                    const BigNum& skipped_iters) {
+  if (!adaptive_) return;
+  bool succeeded = skipped_iters > 0;
+  avg_cost_iters_ += (cost_iters - avg_cost_iters_) / RATE_WINDOW;
+  success_rate_ -= success_rate_ / RATE_WINDOW;
+  success_rate_ += succeeded ? RATE_ONE / RATE_WINDOW : 0;
+  if (++num_attempts_since_adjust_ >= RATE_WINDOW) {
+    if (success_rate_ < RATE_ONE / 4 && threshold_ < MAX_THRESHOLD) {
+      ++threshold_;
+      num_attempts_since_adjust_ = 0;
+    } else if (success_rate_ > RATE_ONE * 3 / 4 && threshold_ > MIN_THRESHOLD) {
+      --threshold_;
+      num_attempts_since_adjust_ = 0;
+    }
+  }
+
+  if (key_stats_.size() >= MAX_NUM_KEYS) {
+    key_stats_.clear();
+    num_backing_off_ = 0;
+  }
+  KeyStats& stats = key_stats_[key_hash];
+  ++stats.num_attempts;
+  if (succeeded) {
+    ++stats.num_successes;
+    num_backing_off_ -= stats.num_failures_in_a_row > 0;
+    stats.num_failures_in_a_row = 0;
+  } else {
+    num_backing_off_ += stats.num_failures_in_a_row == 0;
+    ++stats.num_failures_in_a_row;
+  }
+}
+
+namespace {
+
+const char PATTERN_STORE_MAGIC[8] = {'B', 'B', 'P', 'A', 'T', 'T', 'R', 'N'};
+enum : uint64_t { PATTERN_STORE_VERSION = 1 };
+
+}  // namespace
+
+void ProofMachine::save_patterns(std::ostream& os) const {
+  os.write(PATTERN_STORE_MAGIC, sizeof(PATTERN_STORE_MAGIC));
+  write_uint(os, PATTERN_STORE_VERSION);
+  std::stringstream rule_table_ss;
+  rule_table_ss << rule_table_;
+  write_string(os, rule_table_ss.str());
+  write_uint(os, macro_nbit_);
+  write_uint(os, options_.window_radius);
+  proven_patterns_.save(os);
+}
+
+size_t ProofMachine::load_patterns(std::istream& is) {
+  char magic[sizeof(PATTERN_STORE_MAGIC)];
+  if (!is.read(magic, sizeof(magic)) ||
+      !std::equal(magic, magic + sizeof(magic), PATTERN_STORE_MAGIC)) {
+    throw std::runtime_error("Not a pattern store");
+  }
+  if (read_uint(is) != PATTERN_STORE_VERSION) {
+    throw std::runtime_error("Unsupported pattern store version");
+  }
+  std::stringstream rule_table_ss;
+  rule_table_ss << rule_table_;
+  if (read_string(is) != rule_table_ss.str() ||
+      read_uint(is) != (uint64_t)macro_nbit_ ||
+      read_uint(is) != (uint64_t)options_.window_radius) {
+    throw std::runtime_error(
+        "Pattern store is for a different rule table, macro_nbit or window "
+        "radius");
+  }
+  return proven_patterns_.load(is);
+}
+
+std::ostream& operator<<(std::ostream& os, const ProofMachineStats& stats) {
+  os << stats.num_proofs << " proven";
+  if (stats.num_nested_proofs) {
+    os << " (" << stats.num_nested_proofs << " nested";
+    if (stats.num_driver_proofs) {
+      os << ", " << stats.num_driver_proofs << " closed-form";
+    }
+    os << ")";
+  }
+  if (stats.num_long_period_attempts) {
+    os << ", " << stats.num_long_period_attempts
+       << " attempts over several instances";
+  }
+  os << ", " << stats.num_cache_hits
+     << " cache hits (skipping "
+     << ConcisePrintBigNum(stats.num_cache_hit_iters) << " macro steps), "
+     << stats.num_cache_misses << " misses, "
+     << stats.num_cache_evictions << " evictions; threshold "
+     << stats.instance_threshold << ", " << stats.num_skipped_attempts
+     << " attempts skipped, " << stats.num_backing_off << " backing off; "
+     << stats.num_history_entries << " history entries ("
+     << stats.num_regrown_history_keys << " keys regrown), "
+     << stats.num_kept_instances << " instances kept, "
+     << stats.num_cached_micro_steps << " micro steps cached";
+  return os;
+}
+
+ProofMachine::TrackedSpan* ProofMachine::find_tracked_span(SpanID id) const {
+  for (size_t i = 0; i < num_tracked_spans_; ++i) {
+    if (tracked_spans_[i].id == id) return &tracked_spans_[i];
+  }
+  return nullptr;
+}
+
+void ProofMachine::track_span(SpanID id, int param, const BigNum& coef) const {
+  assert(!find_tracked_span(id));
+  if (num_tracked_spans_ == tracked_spans_.size()) {
+    tracked_spans_.emplace_back();
+  }
+  TrackedSpan& tracked = tracked_spans_[num_tracked_spans_++];
+  tracked.id = id;
+  tracked.param = param;
+  tracked.coef = coef;
+}
+
+void ProofMachine::untrack_span(SpanID id) const {
+  TrackedSpan* tracked = find_tracked_span(id);
+  if (!tracked) return;
+  // Swapping keeps the storage of the coefs.
+  std::swap(*tracked, tracked_spans_[--num_tracked_spans_]);
+}
+
+bool ProofMachine::prove_pattern(Pattern* pattern,
+                                 const PatternKey& pattern_key,
+                                 const PatternInstance& current_instance,
+                                 MacroMachineState* mstate,
+                                 BigNum* num_micro_steps, BigNum* macro_pos,
+                                 BigNum* num_iters) const {
   // At this point the pattern has only been proven for span sizes larger than
   // the current ones.
-  struct SpanInfo {
-    int idx;
-    BigNum min_size;
-    BigNum num_micro_steps_per_symbol;
-    BigNum num_micro_steps_offset;
-  };
-  using SpanInfoMap = std::unordered_map<SpanID, SpanInfo>;
-  SpanInfoMap pattern_span_info;
+  //
+  // The round is replayed symbolically: the starting size of each span that
+  // changes from round to round is a parameter, and the size of each span that
+  // depends on one is tracked as coef * param + offset, where the offset is
+  // implied by the span's actual size (so only the coef is stored). A span's
+  // coef stays 1 unless an inner pattern is applied a no. times that depends on
+  // a parameter, which then becomes the pattern's driver (see Pattern::Driver).
+  num_tracked_spans_ = 0;
+  if (params_.size() < pattern->num_spans()) {
+    params_.resize(pattern->num_spans());
+  }
+  std::vector<Param>& params = params_;
   for (int span_idx = 0; span_idx < (int)pattern->num_spans(); ++span_idx) {
+    Param& param = params[span_idx];
+    param.size0 = current_instance.span_size(span_idx);
+    param.lower_bound = 1;
+    param.num_micro_steps_x2 = 0;
+    param.num_macro_steps = 0;
+    param.num_iters = 0;
     if (pattern->span_size_delta(span_idx) != 0) {
-      pattern_span_info.emplace(
-          current_instance.span_id(span_idx),
-          SpanInfo{span_idx, current_instance.span_size(span_idx), BigNum(0),
-                   BigNum(0)});
+      track_span(current_instance.span_id(span_idx), span_idx, 1);
     }
   }
+  int driver = -1;
+  BigNum driver_num_micro_steps_x2 = 0;  // The coefficient of driver^2.
+  // Raises the lower bound of a tracked span's parameter so that the span's
+  // size (currently size) is at least min_size whenever the bound is met.
+  auto require_min_size = [&](const TrackedSpan& tracked, const BigNum& size,
+                              const BigNum& min_size) {
+    Param& param = params[tracked.param];
+    BigNum lower_bound = min_size - size;
+    mpz_cdiv_q(lower_bound.get_mpz_t(), lower_bound.get_mpz_t(),
+               tracked.coef.get_mpz_t());
+    lower_bound += param.size0;
+    if (lower_bound > param.lower_bound) param.lower_bound = lower_bound;
+  };
+  // The round must not touch the window's fences (if any). Note that SpanID 0
+  // (the left end of the tape) is never deleted, so it can stand for "none".
+  PatternWindow window(*mstate, options_.window_radius);
+  SpanID left_fence_id = window.has_left_fence() ? window.left_fence->id : 0;
+  SpanID right_fence_id = window.has_right_fence() ? window.right_fence->id : 0;
+  BigNum left_fence_size, right_fence_size;
+  if (window.has_left_fence()) left_fence_size = window.left_fence->size;
+  if (window.has_right_fence()) right_fence_size = window.right_fence->size;
   // Run forward for another round of the pattern while keeping track of the
   // min size of each span. The min sizes will determine the starting size
   // lower-bounds for which the pattern is proven to work. We can then use
   // these lower-bounds to derive the number of times the pattern can be
   // applied starting from the current sizes.
-  BigNum pattern_num_micro_steps0 = 0;
-  for (BigNum i = 0; i < pattern->num_iters(); ++i) {
+  BigNum round_num_micro_steps0 = *num_micro_steps;
+  BigNum round_macro_pos0 = *macro_pos;
+  BigNum round_num_iters0 = *num_iters;
+  int max_inner_depth = -1;
+  for (uint64_t i = 0; i < pattern->num_steps(); ++i) {
+    const Pattern* inner_pattern =
+        options_.nested_proofs
+            ? proven_patterns_.find(*mstate, &step_num_times_)
+            : nullptr;
+    if (inner_pattern) {
+      // The inner pattern is applied the same no. times n in every round as
+      // long as the spans that determine n (its fixed and shrinking spans) do
+      // not change from round to round. The exception is when its only
+      // shrinking span is a tracked one, in which case n may be a linear
+      // function of that span's parameter (which becomes the driver). Its
+      // growing spans may change from round to round, in which case they must
+      // stay above its lower bounds, and the micro steps that it spends on
+      // them are attributed to them.
+      const BigNum& n = step_num_times_;
+      Tape::iterator first_span =
+          std::prev(mstate->cur_span, inner_pattern->head_offset());
+      Tape::iterator span = first_span;
+      int num_shrinking = 0;
+      const TrackedSpan* limiting = nullptr;
+      BigNum limiting_delta;
+      for (size_t j = 0; j < inner_pattern->num_spans(); ++j, ++span) {
+        if (span == window.left_fence || span == window.right_fence) {
+          return false;
+        }
+        BigNum delta = inner_pattern->span_size_delta(j);
+        num_shrinking += delta < 0;
+        const TrackedSpan* tracked = find_tracked_span(span->id);
+        if (!tracked) continue;
+        if (delta == 0 || (int)j == inner_pattern->driver().span_idx) {
+          return false;
+        }
+        if (delta < 0) {
+          if (limiting) return false;
+          limiting = tracked;
+          limiting_delta = delta;
+        }
+      }
+      // n = n_coef * params[n_param] + n_offset.
+      int n_param = -1;
+      BigNum n_coef = 0;
+      BigNum n_offset = n;
+      if (limiting) {
+        // n = 1 + (size - lower bound) / -delta is only linear in the
+        // parameter if -delta divides its coef.
+        if (num_shrinking != 1 || inner_pattern->has_driver() ||
+            limiting->coef % limiting_delta != 0) {
+          return false;
+        }
+        if (driver != -1 && driver != limiting->param) return false;
+        driver = n_param = limiting->param;
+        n_coef = limiting->coef / -limiting_delta;
+        n_offset -= n_coef * params[n_param].size0;
+      }
+      // The no. micro steps spent on a span of size s = s_coef * q + s_offset
+      // is m * (n * s + delta * n * (n - 1) / 2) + c * n, and (twice) its terms
+      // that depend on parameters are accumulated here.
+      BigNum m, c;
+      span = first_span;
+      for (size_t j = 0; j < inner_pattern->num_spans(); ++j, ++span) {
+        BigNum delta = inner_pattern->span_size_delta(j);
+        if (delta == 0) continue;
+        const TrackedSpan* tracked = find_tracked_span(span->id);
+        int q = -1;
+        BigNum s_coef = 0;
+        BigNum s_offset = span->size;
+        if (tracked) {
+          require_min_size(*tracked, span->size,
+                           inner_pattern->span_size_lower_bound(j));
+          q = tracked->param;
+          s_coef = tracked->coef;
+          s_offset -= s_coef * params[q].size0;
+        }
+        if (q == -1 && n_param == -1) continue;
+        inner_pattern->get_span_num_micro_steps(j, &m, &c);
+        if (n_param != -1) {
+          if (q != -1) {
+            if (q != n_param) return false;
+            driver_num_micro_steps_x2 += 2 * m * n_coef * s_coef;
+          }
+          driver_num_micro_steps_x2 += m * delta * n_coef * n_coef;
+          params[n_param].num_micro_steps_x2 +=
+              2 * m * n_coef * s_offset +
+              m * delta * n_coef * (2 * n_offset - 1) + 2 * c * n_coef;
+        }
+        if (q != -1) {
+          params[q].num_micro_steps_x2 += 2 * m * n_offset * s_coef;
+        }
+      }
+      if (n_param != -1) {
+        Param& param = params[n_param];
+        param.num_micro_steps_x2 +=
+            2 * inner_pattern->num_micro_steps() * n_coef;
+        param.num_macro_steps += inner_pattern->num_macro_steps() * n_coef;
+        param.num_iters += inner_pattern->num_iters() * n_coef;
+      }
+      inner_pattern->apply(mstate, n, num_micro_steps, macro_pos, num_iters,
+                           &step_pattern_scratch_);
+      if (n_param != -1) {
+        // The spans that the inner pattern grows now depend on the driver, and
+        // the one that it consumed is left at a fixed size.
+        span = first_span;
+        for (size_t j = 0; j < inner_pattern->num_spans(); ++j, ++span) {
+          BigNum delta = inner_pattern->span_size_delta(j);
+          if (delta < 0) {
+            untrack_span(span->id);
+          } else if (delta > 0) {
+            TrackedSpan* tracked = find_tracked_span(span->id);
+            if (!tracked) {
+              track_span(span->id, n_param, delta * n_coef);
+            } else if (tracked->param != n_param) {
+              return false;
+            } else {
+              tracked->coef += delta * n_coef;
+            }
+          }
+        }
+      }
+      ++stats_.num_cache_hits;
+      stats_.num_cache_hit_iters += n * inner_pattern->num_iters();
+      max_inner_depth = std::max(max_inner_depth, inner_pattern->depth());
+      continue;
+    }
     SpanID deleted_span_id = 0;
     Tape::iterator shrunk_span = mstate->tape.end();
-    BigNum num_micro_steps0 = *num_micro_steps;
     BigNum macro_pos0 = *macro_pos;
-    // auto old_cur_span = mstate->cur_span;
-    BigNum old_cur_span_size = mstate->cur_span->size;
     SpanID old_cur_span_id = mstate->cur_span->id;
     BigNum this_num_micro_steps;
     bool did_jump;
@@ -201,98 +1145,364 @@ BigNum ProofMachine::step_with_potential_pattern(
                         &shrunk_span, &this_num_micro_steps, &did_jump);
     ++*num_iters;
     // Check for the pattern breaking.
-    if (deleted_span_id && pattern_span_info.count(deleted_span_id)) {
+    if (mstate->state == STATE_HALT || mstate->state == STATE_NOHALT) {
+      return false;
+    }
+    if (deleted_span_id && (find_tracked_span(deleted_span_id) ||
+                            deleted_span_id == left_fence_id ||
+                            deleted_span_id == right_fence_id)) {
       // The pattern no longer applies.
       // cout << "Pattern no longer applies " << pattern->num_iters() << endl;
-      return 0;
+      return false;
+    }
+    if (mstate->cur_span == window.left_fence ||
+        mstate->cur_span == window.right_fence) {
+      // The head left the window.
+      return false;
     }
     // Track the min size of each span.
     if (shrunk_span != mstate->tape.end()) {
-      auto it = pattern_span_info.find(shrunk_span->id);
-      if (it != pattern_span_info.end()) {
-        it->second.min_size = std::min(it->second.min_size, shrunk_span->size);
+      const TrackedSpan* tracked = find_tracked_span(shrunk_span->id);
+      if (tracked) require_min_size(*tracked, shrunk_span->size, 1);
+    }
+    // Track the no. micro steps (and the macro position) as a function of the
+    // parameters.
+    if (did_jump) {
+      const TrackedSpan* tracked = find_tracked_span(old_cur_span_id);
+      if (tracked) {
+        Param& param = params[tracked->param];
+        param.num_micro_steps_x2 += 2 * this_num_micro_steps * tracked->coef;
+        if (*macro_pos > macro_pos0) {
+          param.num_macro_steps += tracked->coef;
+        } else {
+          param.num_macro_steps -= tracked->coef;
+        }
       }
     }
-    // Track the no. micro steps as a function of the span sizes.
-    SpanInfoMap::iterator old_cur_span_info_iter;
-    if (did_jump && (old_cur_span_info_iter = pattern_span_info.find(
-                         old_cur_span_id)) != pattern_span_info.end()) {
-      auto& old_cur_span_info = old_cur_span_info_iter->second;
-      old_cur_span_info.num_micro_steps_per_symbol += this_num_micro_steps;
-      const BigNum& size0 = current_instance.span_size(old_cur_span_info.idx);
-      old_cur_span_info.num_micro_steps_offset +=
-          this_num_micro_steps * (old_cur_span_size - size0);
-    } else {
-      pattern_num_micro_steps0 += this_num_micro_steps;
+  }
+  // Check that the round ended where it started, between the same (unchanged)
+  // fences and with each span's size changed by its delta.
+  PatternWindow end_window(*mstate, options_.window_radius);
+  if (end_window.left_fence != window.left_fence ||
+      end_window.right_fence != window.right_fence ||
+      !pattern_key.matches(*mstate)) {
+    return false;
+  }
+  if ((window.has_left_fence() && window.left_fence->size != left_fence_size) ||
+      (window.has_right_fence() &&
+       window.right_fence->size != right_fence_size)) {
+    return false;
+  }
+  // The driver's size is instead driver_multiplier * x + (its new delta).
+  BigNum driver_multiplier = 1;
+  int span_idx = 0;
+  for (auto span = end_window.first; span != end_window.last;
+       ++span, ++span_idx) {
+    const BigNum& size0 = params[span_idx].size0;
+    BigNum delta = pattern->span_size_delta(span_idx);
+    const TrackedSpan* tracked = find_tracked_span(span->id);
+    if (delta == 0) {
+      if (tracked || span->size != size0) return false;
+      continue;
+    }
+    // Note: The driver may be consumed and then regrown as a new span.
+    if (!tracked || tracked->param != span_idx ||
+        (span->id != current_instance.span_id(span_idx) &&
+         span_idx != driver)) {
+      return false;
+    }
+    if (span_idx == driver) {
+      driver_multiplier = tracked->coef;
+      pattern->update_span_size_delta(span_idx,
+                                      span->size - driver_multiplier * size0);
+    } else if (tracked->coef != 1 || span->size != size0 + delta) {
+      return false;
     }
   }
   // Update the pattern's lower bounds based on the min span sizes encountered
-  // since the beginning of the pattern.
-  // TODO: Try to clean this up a bit; pattern.num_micro_steps isn't really
-  // meaningful until here.
-  pattern->update_num_micro_steps(pattern_num_micro_steps0);
-  for (const auto& item : pattern_span_info) {
-    auto& span_info = item.second;
-    const BigNum& span_start_size = current_instance.span_size(span_info.idx);
-    BigNum span_size_lower_bound = span_start_size - span_info.min_size + 1;
-    pattern->update_span_size_lower_bound(span_info.idx, span_size_lower_bound);
-    pattern->update_span_num_micro_steps(span_info.idx,
-                                         span_info.num_micro_steps_per_symbol,
-                                         span_info.num_micro_steps_offset);
+  // since the beginning of the pattern, and its micro step counts based on the
+  // coefficients of the parameters (with the remainder being constant).
+  BigNum num_micro_steps_x2 = 2 * (*num_micro_steps - round_num_micro_steps0);
+  for (span_idx = 0; span_idx < (int)pattern->num_spans(); ++span_idx) {
+    if (pattern->span_size_delta(span_idx) == 0) continue;
+    const Param& param = params[span_idx];
+    num_micro_steps_x2 -= param.num_micro_steps_x2 * param.size0;
+    pattern->update_span_size_lower_bound(span_idx, param.lower_bound);
+    if (span_idx == driver) {
+      pattern->update_span_num_micro_steps(span_idx, 0, 0);
+    } else {
+      pattern->update_span_num_micro_steps(span_idx,
+                                           param.num_micro_steps_x2 / 2, 0);
+    }
+  }
+  pattern->update_depth(max_inner_depth + 1);
+  if (driver == -1) {
+    pattern->update_num_micro_steps(num_micro_steps_x2 / 2);
+    return true;
+  }
+  const Param& param = params[driver];
+  num_micro_steps_x2 -= driver_num_micro_steps_x2 * param.size0 * param.size0;
+  Pattern::Driver pattern_driver;
+  pattern_driver.span_idx = driver;
+  pattern_driver.multiplier = driver_multiplier;
+  pattern_driver.num_micro_steps_x2[0] = num_micro_steps_x2;
+  pattern_driver.num_micro_steps_x2[1] = param.num_micro_steps_x2;
+  pattern_driver.num_micro_steps_x2[2] = driver_num_micro_steps_x2;
+  pattern_driver.num_macro_steps_per_symbol = param.num_macro_steps;
+  pattern_driver.num_iters_per_symbol = param.num_iters;
+  pattern->update_driver(pattern_driver);
+  pattern->update_num_micro_steps(0);
+  pattern->update_num_macro_steps(*macro_pos - round_macro_pos0 -
+                                  param.num_macro_steps * param.size0);
+  pattern->update_num_iters(*num_iters - round_num_iters0 -
+                            param.num_iters * param.size0);
+  return true;
+}
+
+const Pattern* ProofMachine::apply_cached_pattern(MacroMachineState* mstate,
+                                                 BigNum* num_micro_steps,
+                                                 BigNum* macro_pos,
+                                                 BigNum* num_iters,
+                                                 BigNum* num_times) const {
+  const Pattern* pattern = proven_patterns_.find(*mstate, num_times);
+  if (!pattern) return nullptr;
+  pattern->apply(mstate, *num_times, num_micro_steps, macro_pos, num_iters,
+                 &step_pattern_scratch_);
+  ++stats_.num_cache_hits;
+  add_product(&stats_.num_cache_hit_iters, *num_times, pattern->num_iters());
+  return pattern;
+}
+
+void ProofMachine::take_step(MacroMachineState* mstate,
+                             BigNum* num_micro_steps, BigNum* macro_pos,
+                             BigNum* num_iters) const {
+  // Step with zeroed counters to obtain the deltas for the history clock.
+  step_num_micro_steps_ = 0;
+  step_num_macro_steps_ = 0;
+  step_num_iters_ = 0;
+  applied_pattern_ =
+      options_.nested_proofs &&
+      apply_cached_pattern(mstate, &step_num_micro_steps_,
+                           &step_num_macro_steps_, &step_num_iters_,
+                           &step_num_times_);
+  if (applied_pattern_) {
+    round_tracker_.stop();
+  } else if (round_tracker_.active()) {
+    SpanID old_cur_span_id = mstate->cur_span->id;
+    step_old_cur_span_size_ = mstate->cur_span->size;
+    SpanID deleted_span_id = 0;
+    Tape::iterator shrunk_span = mstate->tape.end();
+    bool did_jump;
+    macro_machine_.step(mstate, &step_num_micro_steps_, &step_num_macro_steps_,
+                        &deleted_span_id, &shrunk_span,
+                        &step_this_num_micro_steps_, &did_jump);
+    round_tracker_.track_macro_step(*mstate, old_cur_span_id,
+                                    step_old_cur_span_size_, deleted_span_id,
+                                    shrunk_span, step_this_num_micro_steps_,
+                                    did_jump);
+    step_num_iters_ = 1;
+  } else {
+    macro_machine_.step(mstate, &step_num_micro_steps_,
+                        &step_num_macro_steps_);
+    step_num_iters_ = 1;
   }
-  return pattern->apply(mstate, num_micro_steps, macro_pos, num_iters);
+  *num_micro_steps += step_num_micro_steps_;
+  *macro_pos += step_num_macro_steps_;
+  *num_iters += step_num_iters_;
+  ++history_num_steps_;
+  history_num_micro_steps_ += step_num_micro_steps_;
+  history_macro_pos_ += step_num_macro_steps_;
+  history_num_iters_ += step_num_iters_;
+}
+
+PatternHistory* ProofMachine::watched_history(
+    const MacroMachineState& mstate) const {
+  size_t key_hash = PatternKey::hash(mstate, options_.window_radius);
+  bool new_key;
+  int watch_idx = pipeline_->record_step(key_hash, &new_key);
+  if (watch_idx == -1) return nullptr;
+  PatternKey& key = watched_keys_[watch_idx];
+  PatternHistory& history = watched_histories_[watch_idx];
+  if (new_key) {
+    key.assign(mstate);
+    history.num_instances = 0;
+    history.key_hash = key_hash;
+    history.instances.clear();
+  } else if (!key.matches(mstate)) {
+    // Another tape pattern with the same hash.
+    return nullptr;
+  }
+  if (!history.num_instances) {
+    // The pipeline has already seen the tape pattern recur enough times.
+    history.num_instances = scheduler_.threshold(key_hash) - 1;
+  }
+  return &history;
+}
+
+void ProofMachine::clear_history() const {
+  history_map_.clear();
+  for (PatternHistory& history : watched_histories_) {
+    history.num_instances = 0;
+    history.instances.clear();
+  }
+  round_tracker_.stop();
+  history_num_steps_ = 0;
+  history_num_micro_steps_ = 0;
+  history_macro_pos_ = 0;
+  history_num_iters_ = 0;
+}
+
+bool ProofMachine::at_history_anchor(const MacroMachineState& mstate) const {
+  const unsigned anchors = options_.history_anchors;
+  bool span_changed = mstate.tape.size() != last_num_spans_;
+  last_num_spans_ = mstate.tape.size();
+  if ((anchors & ANCHOR_SPAN_CHANGE) && span_changed) return true;
+  if ((anchors & ANCHOR_TAPE_END) &&
+      (mstate.cur_span == mstate.tape.begin() ||
+       std::next(mstate.cur_span) == mstate.tape.end())) {
+    return true;
+  }
+  return (anchors & ANCHOR_STATE) && mstate.state == options_.anchor_state &&
+         mstate.moving_right == options_.anchor_moving_right;
+}
+
+void ProofMachine::attempt_proof(Pattern* pattern,
+                                 const PatternInstance& historic_instance,
+                                 size_t key_hash, bool nohalt,
+                                 MacroMachineState* mstate,
+                                 BigNum* num_micro_steps, BigNum* macro_pos,
+                                 BigNum* num_iters) const {
+  ++stats_.num_cache_misses;
+  applied_pattern_ = false;
+  PatternKey& pattern_key = step_pattern_key_;
+  pattern_key.assign(*mstate);
+  BigNum num_skipped_iters = 0;
+  // If the round since the historic instance was tracked then it already
+  // proves the pattern (or not), otherwise another round is replayed.
+  bool tracked =
+      round_tracker_.active() &&
+      round_tracker_.start_step_num() == historic_instance.step_num();
+  if (tracked ? round_tracker_.prove_pattern(historic_instance, *mstate,
+                                             options_.window_radius, pattern)
+              : prove_pattern(pattern, pattern_key, current_instance_, mstate,
+                              num_micro_steps, macro_pos, num_iters)) {
+    // The driver's delta in the previous round says nothing about whether it
+    // will shrink, which depends on its current size.
+    if (pattern->has_driver()) {
+      pattern->num_times_applicable(*mstate, &step_num_times_,
+                                    &step_pattern_scratch_);
+      nohalt = step_num_times_ == -1;
+    }
+    if (nohalt) {
+      mstate->nohalt_reason = "NON-SHRINKING PATTERN";
+      mstate->state = STATE_NOHALT;
+      return;
+    }
+    if (pattern->apply(mstate, num_micro_steps, macro_pos,
+                       &num_skipped_iters) > 0) {
+      ++stats_.num_proofs;
+      stats_.num_nested_proofs += pattern->depth() > 0;
+      stats_.num_driver_proofs += pattern->has_driver();
+      stats_.num_cache_evictions +=
+          proven_patterns_.insert(pattern_key, *pattern);
+      applied_pattern_ = true;
+      *num_iters += num_skipped_iters;
+    }
+  }
+  scheduler_.record_attempt(key_hash, history_num_iters_, num_skipped_iters);
+  stats_.num_backing_off = scheduler_.num_backing_off();
+  stats_.instance_threshold = scheduler_.threshold();
+  clear_history();
 }
 
 void ProofMachine::step(MacroMachineState* mstate, BigNum* num_micro_steps,
                         BigNum* macro_pos, BigNum* num_iters) const {
-  PatternKey pattern_key(*mstate);
-
-  //// HACK TESTING (seems to only be useful for one or two machines?)
-  // auto pattern_it = proven_patterns_.find(pattern_key);
-  // if (pattern_it != proven_patterns_.end()) {
-  //  //cout << "******* Applying existing pattern to skip "
-  //  //  << pattern_it->second.num_iters() << " iterations" << endl;
-  //  pattern_it->second.apply(mstate, num_micro_steps, macro_pos, num_iters);
-  //  //cout << proven_patterns_.size() << endl;
-  //}
-
-  historic_instances_type* historic_instances = &history_map_[pattern_key];
-  PatternInstance current_instance(mstate->tape, *num_micro_steps, *macro_pos,
-                                   *num_iters);
-
-  if (historic_instances->size() >= PATTERN_INSTANCE_THRESHOLD) {
-    const PatternInstance& historic_instance = historic_instances->back();
-    Pattern pattern;
+  if (options_.history_anchors && !at_history_anchor(*mstate)) {
+    take_step(mstate, num_micro_steps, macro_pos, num_iters);
+    return;
+  }
+  if (!options_.nested_proofs) {
+    // Pattern applications are not part of the history.
+    if (apply_cached_pattern(mstate, num_micro_steps, macro_pos, num_iters,
+                             &step_num_times_)) {
+      clear_history();
+      return;
+    }
+  } else if (applied_pattern_) {
+    // The state after a pattern application is not recorded.
+    take_step(mstate, num_micro_steps, macro_pos, num_iters);
+    return;
+  }
+
+  PatternHistory* history =
+      pipeline_ ? watched_history(*mstate) : &history_map_[*mstate];
+  if (!history) {
+    take_step(mstate, num_micro_steps, macro_pos, num_iters);
+    return;
+  }
+  // Instances are only compared with later ones once the threshold is reached,
+  // so earlier ones are only counted. The tape pattern's own threshold (which
+  // is never lower) is only looked up once the machine's one is reached.
+  uint64_t threshold = scheduler_.threshold();
+  if (history->num_instances + 1 >= threshold) {
+    threshold = scheduler_.threshold(history->key_hash);
+  }
+  bool keep_instance = history->num_instances + 1 >= threshold;
+  if (keep_instance) {
+    current_instance_.assign(PatternWindow(*mstate, options_.window_radius),
+                             history_num_steps_, history_num_micro_steps_,
+                             history_macro_pos_, history_num_iters_);
+  }
+
+  if (history->num_instances >= threshold) {
+    Pattern& pattern = step_pattern_;
     bool nohalt;
-    if (historic_instance.confirm_pattern(current_instance, &pattern,
-                                          &nohalt)) {
-      if (nohalt) {
-        // TODO: Return this via a msg or similar instead of printing.
-        cout << "NON-SHRINKING PATTERN" << endl;
+    // Patterns whose rounds span several instances of their key are only
+    // looked for if those with shorter (i.e., cheaper to prove) rounds fail.
+    for (int age = 0; age < history->instances.size(); ++age) {
+      const PatternInstance& historic_instance =
+          history->instances.from_back(age);
+      if (!historic_instance.confirm_pattern(
+              current_instance_, options_.nested_proofs, &pattern, &nohalt)) {
+        continue;
+      }
+      // Note: A whole-tape pattern of macro steps that does not shrink is
+      // already proven, but a windowed one must first be checked to stay
+      // within its window, and a nested one to apply its inner patterns the
+      // same no. times in every round.
+      if (nohalt && !options_.window_radius && !options_.nested_proofs) {
+        mstate->nohalt_reason = "NON-SHRINKING PATTERN";
         mstate->state = STATE_NOHALT;
         return;
       }
 
-      // TODO: Consider not doing this if the pattern could only be applied
-      // a small no. times (e.g., once) anyway.
-      BigNum num_pattern_repeats =
-          step_with_potential_pattern(&pattern, current_instance, mstate,
-                                      num_micro_steps, macro_pos, num_iters);
-      //*proven_patterns_.emplace(pattern_key, pattern);
-      // if (double(rand()) / RAND_MAX < 1e-2) { // HACK TESTING
-      // cout << "***************** Applied pattern " << num_pattern_repeats
-      //     << " times jumping " << num_pattern_repeats * pattern.num_iters()
-      //     << " iterations and "
-      //     << num_pattern_repeats * pattern.num_micro_steps() << " steps"
-      //     << endl;
-      //}
-      // return;
-
-      history_map_.clear();
-      return;
+      // Attempts discard the history, so unless the pattern is predicted to
+      // skip enough macro steps to make up for that, it is instead recorded
+      // as just another instance (and the round tracker restarted from it).
+      if (scheduler_.should_attempt(
+              history->key_hash,
+              predict_num_times_applicable(pattern, current_instance_),
+              pattern.num_iters())) {
+        stats_.num_long_period_attempts += age > 0;
+        attempt_proof(&pattern, historic_instance, history->key_hash, nohalt,
+                      mstate, num_micro_steps, macro_pos, num_iters);
+        return;
+      }
+      stats_.num_skipped_attempts = scheduler_.num_skipped();
+      round_tracker_.stop();
+      break;
+    }
+  }
+  ++history->num_instances;
+  if (keep_instance) {
+    ++stats_.num_kept_instances;
+    // Swap the current instance into the history, recycling the storage of the
+    // instance it replaces.
+    std::swap(history->instances.push_back_recycled(), current_instance_);
+    if (!round_tracker_.active()) {
+      round_tracker_.start(PatternWindow(*mstate, options_.window_radius),
+                           history_num_steps_);
     }
   }
-  historic_instances->push_back(current_instance);
-  macro_machine_.step(mstate, num_micro_steps, macro_pos);
-  ++*num_iters;
+  take_step(mstate, num_micro_steps, macro_pos, num_iters);
 }
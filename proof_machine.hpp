@@ -29,36 +29,125 @@
 #pragma once
 
 #include "macro_machine.hpp"
+#include "proof_pipeline.hpp"
+#include "ring_buffer.hpp"
 #include "util.hpp"
 
+#include <deque>
 #include <iostream>
+#include <memory>
 
+// The range of spans that patterns are keyed on and restricted to. With a
+// radius of 0 this is the whole tape. Otherwise it is the span under the head
+// and up to radius spans either side of it, and the spans just outside of it
+// (if any) are its "fences". The fences' symbols are part of a pattern's key
+// because they determine whether spans at the edge of the window merge with
+// them, but their sizes are not, so a pattern must never move the head onto a
+// fence or otherwise modify it.
+struct PatternWindow {
+  PatternWindow(const MacroMachineState& mstate, int radius);
+
+  Tape::const_iterator first;        // The first span in the window.
+  Tape::const_iterator last;         // One past the last span in the window.
+  Tape::const_iterator left_fence;   // Or tape.end() if there is none.
+  Tape::const_iterator right_fence;  // Or tape.end() if there is none.
+  Tape::const_iterator tape_end;
+  int num_spans;
+  int head_offset;  // Index of the head's span within the window.
+
+  bool has_left_fence() const { return left_fence != tape_end; }
+  bool has_right_fence() const { return right_fence != tape_end; }
+  // The range of spans whose symbols form the key (the window plus fences).
+  Tape::const_iterator key_begin() const {
+    return has_left_fence() ? left_fence : first;
+  }
+  Tape::const_iterator key_end() const {
+    return has_right_fence() ? std::next(right_fence) : last;
+  }
+  int num_key_spans() const {
+    return num_spans + has_left_fence() + has_right_fence();
+  }
+  int key_head_offset() const { return head_offset + has_left_fence(); }
+};
+
+// Note: cur_span_idx here is the index of the head's span within symbols(),
+// which are the symbols of the key spans of a PatternWindow.
 class PatternKey : public std::tuple<uint, std::vector<MacroSym>, uint, bool> {
   typedef std::tuple<uint, std::vector<MacroSym>, uint, bool> super_type;
 
  public:
-  explicit PatternKey(const MacroMachineState& mstate)
-      : super_type(
-            mstate.state, tape_symbols(mstate.tape),
-            std::distance(mstate.tape.begin(),
-                          static_cast<Tape::const_iterator>(mstate.cur_span)),
-            mstate.moving_right) {}
+  explicit PatternKey(const MacroMachineState& mstate, int window_radius = 0)
+      : window_radius_(window_radius) {
+    assign(mstate);
+  }
+  // An empty key, to be assigned later.
+  explicit PatternKey(int window_radius)
+      : hash_(0), window_radius_(window_radius) {}
+
+  // Overwrites this key with the key of mstate, reusing its storage.
+  void assign(const MacroMachineState& mstate) {
+    PatternWindow window(mstate, window_radius_);
+    std::get<0>(*this) = mstate.state;
+    std::vector<MacroSym>& symbols = std::get<1>(*this);
+    symbols.clear();
+    for (auto span = window.key_begin(); span != window.key_end(); ++span) {
+      symbols.push_back(span->symbol);
+    }
+    std::get<2>(*this) = window.key_head_offset();
+    std::get<3>(*this) = mstate.moving_right;
+    hash_ = hash(mstate, window_radius_);
+  }
 
   uint state() const { return std::get<0>(*this); }
   const std::vector<MacroSym>& symbols() const { return std::get<1>(*this); }
   uint cur_span_idx() const { return std::get<2>(*this); }
   bool moving_right() const { return std::get<3>(*this); }
+  int window_radius() const { return window_radius_; }
 
-  size_t hash() const {
+  size_t hash() const { return hash_; }
+
+  // Returns the hash of the key that would be constructed from mstate. This is
+  // O(1) for whole-tape keys because the tape's symbols hash is maintained
+  // incrementally, and O(window_radius) otherwise.
+  static size_t hash(const MacroMachineState& mstate, int window_radius = 0) {
     using detail::hash_combine;
-    size_t symbols_hash = 0;
-    for (const auto& symbol : symbols()) {
-      symbols_hash = hash_combine(symbols_hash, symbol);
+    if (window_radius) return window_hash(mstate, window_radius);
+    return hash_combine(mstate.state, mstate.symbols_hash, mstate.tape.size(),
+                        mstate.cur_span_idx, mstate.moving_right);
+  }
+
+  // Returns true if this key is equal to the key that would be constructed
+  // from mstate (without actually constructing it).
+  bool matches(const MacroMachineState& mstate) const {
+    PatternWindow window(mstate, window_radius_);
+    if (state() != mstate.state || moving_right() != mstate.moving_right ||
+        cur_span_idx() != (uint)window.key_head_offset() ||
+        symbols().size() != (size_t)window.num_key_spans()) {
+      return false;
     }
-    return hash_combine(state(), symbols_hash, cur_span_idx(), moving_right());
+    auto symbol = symbols().begin();
+    for (auto span = window.key_begin(); span != window.key_end(); ++span) {
+      if (span->symbol != *symbol++) return false;
+    }
+    return true;
   }
 
   friend std::ostream& operator<<(std::ostream& os, const PatternKey& key);
+
+  // Binary serialization (see ProofMachine::save_patterns). read() throws
+  // std::runtime_error if the input is malformed.
+  void write(std::ostream& os) const;
+  void read(std::istream& is);
+
+ private:
+  static size_t window_hash(const MacroMachineState& mstate,
+                            int window_radius);
+  // Returns the hash of the key from its contents (which is the same as the
+  // hash of the state it was constructed from).
+  size_t compute_hash() const;
+
+  size_t hash_;
+  int window_radius_;
 };
 
 namespace std {
@@ -68,27 +157,85 @@ struct hash<PatternKey> {
 };
 }  // namespace std
 
+// Returns x_n, where x_{k+1} = a * x_k + b (with a >= 1), and writes the sums
+// of x_k and x_k^2 over k in [0, n) to *sum1 and *sum2. Note that n must fit in
+// an unsigned long if a > 1. This is how a pattern's driver span (see
+// Pattern::Driver) is applied in closed form.
+BigNum affine_sequence_sums(const BigNum& x0, const BigNum& a, const BigNum& b,
+                            const BigNum& n, BigNum* sum1, BigNum* sum2);
+
 class Pattern {
  public:
+  // A pattern may have a "driver" span, whose size x changes to a * x + b in
+  // each round (where b is the span's size delta) instead of by a constant.
+  // This happens when an inner pattern that consumes the span is applied x
+  // times per round (e.g., to double another span, which a later inner pattern
+  // then consumes to regrow the driver). The no. micro steps in a round is then
+  // quadratic in x, and successive rounds are applied in closed form.
+  struct Driver {
+    int span_idx = -1;
+    BigNum multiplier;  // a
+    // Twice the coefficients of 1, x and x^2 in the no. micro steps per round.
+    BigNum num_micro_steps_x2[3];
+    BigNum num_macro_steps_per_symbol;
+    BigNum num_iters_per_symbol;
+  };
+  // The max no. rounds applied at once when the driver grows geometrically.
+  enum { MAX_GEOMETRIC_DRIVER_ROUNDS = 1 << 12 };
+
   Pattern() = default;
   Pattern(const std::vector<std::pair<BigNum, BigNum>>& lbounds_and_deltas,
-          BigNum num_micro_steps, BigNum num_macro_steps, BigNum num_iters)
+          int head_offset, uint64_t num_steps, BigNum num_micro_steps,
+          BigNum num_macro_steps, BigNum num_iters)
       : lbounds_and_deltas_(lbounds_and_deltas),
+        head_offset_(head_offset),
+        num_steps_(num_steps),
+        depth_(0),
         num_micro_steps_(num_micro_steps),
         num_macro_steps_(num_macro_steps),
         num_iters_(num_iters) {}
+  // Resets this to a pattern of macro steps with the given no. spans (whose
+  // lower bounds and deltas must then be updated), reusing its storage.
+  void assign(size_t num_spans, int head_offset, uint64_t num_steps) {
+    lbounds_and_deltas_.resize(num_spans);
+    head_offset_ = head_offset;
+    num_steps_ = num_steps;
+    depth_ = 0;
+    span_num_micro_steps_.clear();
+    driver_.span_idx = -1;
+  }
   size_t num_spans() const { return lbounds_and_deltas_.size(); }
-  BigNum num_iters() const { return num_iters_; }
-  BigNum num_micro_steps() const { return num_micro_steps_; }
+  // The index of the head's span within the pattern's spans.
+  int head_offset() const { return head_offset_; }
+  // The no. proof steps (macro steps or applications of other patterns) in
+  // one round of the pattern.
+  uint64_t num_steps() const { return num_steps_; }
+  // The max nesting depth of other patterns applied within a round of the
+  // pattern (0 if it consists only of macro steps).
+  int depth() const { return depth_; }
+  void update_depth(int depth) { depth_ = depth; }
+  const BigNum& num_iters() const { return num_iters_; }
+  const BigNum& num_micro_steps() const { return num_micro_steps_; }
+  const BigNum& num_macro_steps() const { return num_macro_steps_; }
+  bool has_driver() const { return driver_.span_idx != -1; }
+  const Driver& driver() const { return driver_; }
+  void update_driver(const Driver& driver) { driver_ = driver; }
   BigNum span_size_lower_bound(size_t span_idx) const {
     return lbounds_and_deltas_[span_idx].first;
   }
   void update_span_size_lower_bound(size_t span_idx, BigNum lower_bound) {
     lbounds_and_deltas_[span_idx].first = lower_bound;
   }
+  void update_span_size_delta(size_t span_idx, BigNum delta) {
+    lbounds_and_deltas_[span_idx].second = delta;
+  }
   void update_num_micro_steps(const BigNum& num_micro_steps) {
     num_micro_steps_ = num_micro_steps;
   }
+  void update_num_macro_steps(const BigNum& num_macro_steps) {
+    num_macro_steps_ = num_macro_steps;
+  }
+  void update_num_iters(const BigNum& num_iters) { num_iters_ = num_iters; }
   void update_span_num_micro_steps(size_t span_idx,
                                    BigNum num_micro_steps_per_symbol,
                                    BigNum num_micro_steps_offset) {
@@ -100,89 +247,597 @@ class Pattern {
   BigNum span_size_delta(size_t span_idx) const {
     return lbounds_and_deltas_[span_idx].second;
   }
+  // Returns the no. micro steps that one application of the pattern spends on
+  // the given span, as a function of the span's size s at the start of it:
+  // micro_steps_per_symbol * s + micro_steps_offset.
+  void get_span_num_micro_steps(size_t span_idx,
+                                BigNum* num_micro_steps_per_symbol,
+                                BigNum* num_micro_steps_offset) const {
+    if (span_idx < span_num_micro_steps_.size()) {
+      *num_micro_steps_per_symbol = span_num_micro_steps_[span_idx].first;
+      *num_micro_steps_offset = span_num_micro_steps_[span_idx].second;
+    } else {
+      *num_micro_steps_per_symbol = *num_micro_steps_offset = 0;
+    }
+  }
+
+  // Storage for the temporaries of num_times_applicable() and apply(), which
+  // callers keep so that they can be reused.
+  struct Scratch {
+    BigNum span_num_times;
+    BigNum sum_m_s0;
+    BigNum sum_m_delta;
+    BigNum sum_c;
+  };
+
+  // Writes the no. times the pattern can be applied to mstate (which may be 0,
+  // indicating that it cannot be applied, or -1 if it never shrinks) to
+  // *num_times. Note that this is capped at MAX_GEOMETRIC_DRIVER_ROUNDS for
+  // patterns whose driver grows geometrically.
+  void num_times_applicable(const MacroMachineState& mstate, BigNum* num_times,
+                            Scratch* scratch) const;
 
   // Updates all args and returns the no. times the rule was applied (which may
   // be 0, indicating that the pattern could not be applied).
   BigNum apply(MacroMachineState* mstate, BigNum* num_micro_steps,
                BigNum* num_macro_steps, BigNum* num_iters) const;
+  // As above, but applies the pattern the given (applicable) no. times. Only
+  // patterns with a driver allocate temporaries outside of *scratch.
+  void apply(MacroMachineState* mstate, const BigNum& num_times,
+             BigNum* num_micro_steps, BigNum* num_macro_steps,
+             BigNum* num_iters, Scratch* scratch) const;
 
   friend std::ostream& operator<<(std::ostream& os, const Pattern& pattern);
 
- private:
-  BigNum num_times_applicable(const MacroMachineState& mstate) const;
+  // Binary serialization (see ProofMachine::save_patterns). read() throws
+  // std::runtime_error if the input is malformed.
+  void write(std::ostream& os) const;
+  void read(std::istream& is);
 
+ private:
   std::vector<std::pair<BigNum, BigNum>> lbounds_and_deltas_;
+  int head_offset_;
+  uint64_t num_steps_;
+  int depth_;
   BigNum num_micro_steps_;
   BigNum num_macro_steps_;
   BigNum num_iters_;
   // For each span: (num_micro_steps_per_symbol, num_micro_steps_offset)
   std::vector<std::pair<BigNum, BigNum>> span_num_micro_steps_;
+  Driver driver_;
 };
 
+// A snapshot of the span sizes and IDs of a pattern window, along with the
+// values of the proof machine's history clock (see ProofMachine) at the time it
+// was taken. Values are stored as CompactBigNums because span sizes and history
+// clock values are usually small, and the history holds very many of these.
 class PatternInstance {
-  BigNum micro_step_num_;
-  BigNum macro_pos_;
-  BigNum iter_num_;
-  std::vector<std::pair<BigNum, SpanID>> span_sizes_and_ids_;
+  uint64_t step_num_;
+  CompactBigNum micro_step_num_;
+  CompactBigNum macro_pos_;
+  CompactBigNum iter_num_;
+  std::vector<CompactBigNum> span_sizes_;
+  std::vector<SpanID> span_ids_;
+  int head_offset_;
 
  public:
-  explicit PatternInstance(const Tape& tape, BigNum micro_step_num,
-                           BigNum macro_pos, BigNum iter_num)
-      : micro_step_num_(micro_step_num),
-        macro_pos_(macro_pos),
-        iter_num_(iter_num) {
-    span_sizes_and_ids_.reserve(tape.size());
-    for (const auto& span : tape) {
-      span_sizes_and_ids_.push_back(std::make_pair(span.size, span.id));
-    }
+  PatternInstance() = default;
+  explicit PatternInstance(const PatternWindow& window, uint64_t step_num,
+                           const BigNum& micro_step_num,
+                           const BigNum& macro_pos, const BigNum& iter_num) {
+    assign(window, step_num, micro_step_num, macro_pos, iter_num);
   }
-  const BigNum& iter_num() const { return iter_num_; }
-  size_t num_spans() const { return span_sizes_and_ids_.size(); }
-  const BigNum& span_size(size_t span_idx) const {
-    return span_sizes_and_ids_[span_idx].first;
+  // Overwrites this instance, reusing its storage.
+  void assign(const PatternWindow& window, uint64_t step_num,
+              const BigNum& micro_step_num, const BigNum& macro_pos,
+              const BigNum& iter_num) {
+    step_num_ = step_num;
+    micro_step_num_ = micro_step_num;
+    macro_pos_ = macro_pos;
+    iter_num_ = iter_num;
+    span_sizes_.resize(window.num_spans);
+    span_ids_.resize(window.num_spans);
+    size_t span_idx = 0;
+    for (auto span = window.first; span != window.last; ++span) {
+      span_sizes_[span_idx] = span->size;
+      span_ids_[span_idx] = span->id;
+      ++span_idx;
+    }
+    head_offset_ = window.head_offset;
   }
-  SpanID span_id(size_t span_idx) const {
-    return span_sizes_and_ids_[span_idx].second;
+  uint64_t step_num() const { return step_num_; }
+  BigNum iter_num() const { return iter_num_.get(); }
+  size_t num_spans() const { return span_sizes_.size(); }
+  BigNum span_size(size_t span_idx) const {
+    return span_sizes_[span_idx].get();
   }
+  SpanID span_id(size_t span_idx) const { return span_ids_[span_idx]; }
 
   // If the transition *this -> later_instance forms a proven pattern, this
-  // method writes the pattern to *pattern and returns true; otherwise it
-  // returns false. If the pattern is proven, *nohalt is set to true if the
-  // pattern does not shrink with time and otherwise false.
-  bool confirm_pattern(const PatternInstance& later_instance, Pattern* pattern,
+  // method writes the pattern to *pattern (reusing its storage) and returns
+  // true; otherwise it returns false (and *pattern may have been modified). If
+  // the pattern is proven, *nohalt is set to true if the pattern does not
+  // shrink with time and otherwise false. If allow_respawn is true, one span
+  // may have been replaced by another of a different size (in which case the
+  // pattern is only a candidate, because this is only valid for a driver span;
+  // see ProofMachine::prove_pattern).
+  bool confirm_pattern(const PatternInstance& later_instance,
+                       bool allow_respawn, Pattern* pattern,
                        bool* nohalt) const;
 
   friend std::ostream& operator<<(std::ostream& os,
                                   const PatternInstance& inst);
 };
 
-class ProofMachine {
-  enum { PATTERN_INSTANCE_THRESHOLD = 3 };
+// Records what prove_pattern would learn from replaying a round, but over the
+// round that follows an instance in the history: the min size of each span in
+// the instance's window and the micro steps spent jumping over it. When the
+// instance's pattern next recurs, this is enough to prove it without running
+// another round. Rounds that apply other patterns (with nested proofs) are not
+// tracked, and are instead proven by replaying them.
+class RoundTracker {
+ public:
+  bool active() const { return active_; }
+  // The history clock step no. of the instance that the round started at.
+  uint64_t start_step_num() const { return start_step_num_; }
+
+  void start(const PatternWindow& window, uint64_t step_num);
+  void stop() { active_ = false; }
+  // Records a macro step (see MacroMachine::step for the args).
+  void track_macro_step(const MacroMachineState& mstate,
+                        SpanID old_cur_span_id,
+                        const BigNum& old_cur_span_size,
+                        SpanID deleted_span_id, Tape::iterator shrunk_span,
+                        const BigNum& this_num_micro_steps, bool did_jump);
+
+  // Fills in the span size lower bounds and micro step counts of a pattern
+  // confirmed from the tracked round (which must have started at
+  // start_instance and ended at mstate). Returns false if the round does not
+  // prove the pattern.
+  bool prove_pattern(const PatternInstance& start_instance,
+                     const MacroMachineState& mstate, int window_radius,
+                     Pattern* pattern) const;
+
+ private:
+  struct SpanInfo {
+    BigNum size0;
+    BigNum min_size;
+    BigNum num_micro_steps_per_symbol;
+    BigNum num_micro_steps_offset;
+  };
+  // Returns the info of the window span with the given ID, or nullptr.
+  SpanInfo* find_span_info(SpanID id);
+
+  bool active_ = false;
+  uint64_t start_step_num_;
+  // The info of each span in the window, in tape order, and (span ID, index)
+  // pairs sorted by ID for looking it up. These are only ever grown, so that
+  // their storage is reused from round to round.
+  int num_spans_ = 0;
+  std::vector<SpanInfo> span_info_;
+  std::vector<std::pair<SpanID, int>> span_idxs_by_id_;
+  // The round must not touch the window's fences (if any).
+  bool has_left_fence_;
+  bool has_right_fence_;
+  SpanID left_fence_id_;
+  SpanID right_fence_id_;
+  BigNum left_fence_size_;
+  BigNum right_fence_size_;
+  BigNum num_micro_steps_offset_delta_;  // Scratch for track_macro_step().
+};
+
+// A bounded cache of proven patterns, keyed by the tape pattern that they start
+// (and end) at. The least-recently-used pattern is evicted when it is full.
+// A tape pattern may have one pattern per nesting depth (e.g., a pattern may
+// be built from repeated applications of a shallower one with the same key).
+class PatternCache {
+  typedef FastList<std::pair<PatternKey, Pattern>> list_type;
+
+ public:
+  PatternCache(size_t capacity, int window_radius)
+      : capacity_(capacity), window_radius_(window_radius) {}
+  // Copies rebind index_ (which holds iterators into entries_) to the copied
+  // entries.
+  PatternCache(const PatternCache& other);
+  PatternCache& operator=(const PatternCache&) = delete;
+
+  // Returns the deepest cached pattern for the tape pattern of mstate that can
+  // be applied to it (and marks it as the most recently used), or nullptr if
+  // there is none. The no. times it can be applied is written to *num_times.
+  const Pattern* find(const MacroMachineState& mstate, BigNum* num_times);
+  // Inserts (or replaces) the pattern for the given key and the pattern's
+  // depth. Returns true if another pattern had to be evicted to make room.
+  bool insert(const PatternKey& key, const Pattern& pattern);
+  size_t size() const { return entries_.size(); }
 
+  // Writes the cached patterns (from least to most recently used), or reads
+  // patterns written by save() and inserts them in the same order. load()
+  // throws std::runtime_error (and inserts nothing) if the input is malformed,
+  // and returns the no. patterns read.
+  void save(std::ostream& os) const;
+  size_t load(std::istream& is);
+  size_t capacity() const { return capacity_; }
+
+ private:
+  size_t capacity_;
+  int window_radius_;
+  list_type entries_;  // Ordered from most to least recently used.
+  std::unordered_multimap<size_t, list_type::iterator> index_;
+  // Scratch for find().
+  BigNum entry_num_times_;
+  Pattern::Scratch pattern_scratch_;
+};
+
+// Decides when confirmed patterns are worth attempting to prove. Each attempt
+// costs the macro steps of history that it discards (which must be simulated
+// again before another pattern can be confirmed), and pays off with the macro
+// steps skipped by applying the pattern it proves. The scheduler learns these
+// for the machine as a whole (raising the instance threshold while attempts
+// mostly fail and lowering it while they mostly succeed) and per tape pattern
+// (backing off on patterns whose attempts keep failing), and skips attempts
+// whose predicted payoff does not cover the predicted cost.
+class ProofScheduler {
+ public:
+  enum { MIN_THRESHOLD = 2, DEFAULT_THRESHOLD = 3, MAX_THRESHOLD = 6 };
+
+  explicit ProofScheduler(bool adaptive)
+      : adaptive_(adaptive), threshold_(DEFAULT_THRESHOLD) {}
+
+  // The no. instances of a tape pattern that must be seen before it is
+  // compared with later ones (a lower bound on the per-pattern threshold).
+  uint64_t threshold() const { return threshold_; }
+  // The threshold for the tape pattern with the given key hash, which is
+  // raised exponentially while its attempts keep failing.
+  uint64_t threshold(size_t key_hash) const;
+  // Returns true if a pattern that was confirmed at the tape pattern with the
+  // given key hash should be proven, given that it is predicted to apply
+  // num_times times (-1 if it never shrinks) with num_iters macro steps each.
+  bool should_attempt(size_t key_hash, const BigNum& num_times,
+                      const BigNum& num_iters);
+  // Records the cost and payoff (0 if it failed) of an attempt.
+  void record_attempt(size_t key_hash, const BigNum& cost_iters,
+                      const BigNum& skipped_iters);
+
+  uint64_t num_skipped() const { return num_skipped_; }
+  // The no. tape patterns whose last attempt failed.
+  size_t num_backing_off() const { return num_backing_off_; }
+
+ private:
+  enum { MAX_BACKOFF_SHIFT = 5 };
+  // The per-pattern stats are forgotten when there are this many.
+  enum { MAX_NUM_KEYS = 1 << 16 };
+  // The success rate is a moving average over roughly this many attempts, and
+  // the threshold is adjusted at most once per this many attempts.
+  enum { RATE_WINDOW = 8 };
+  // Success rates are in units of 1 / RATE_ONE.
+  enum { RATE_ONE = 256 };
+  struct KeyStats {
+    uint32_t num_attempts = 0;
+    uint32_t num_successes = 0;
+    uint32_t num_failures_in_a_row = 0;
+  };
+
+  bool adaptive_;
+  uint64_t threshold_;
+  uint64_t success_rate_ = RATE_ONE / 2;
+  uint64_t num_attempts_since_adjust_ = 0;
+  BigNum avg_cost_iters_ = 0;
+  uint64_t num_skipped_ = 0;
+  size_t num_backing_off_ = 0;
+  std::unordered_map<size_t, KeyStats> key_stats_;
+  // Scratch space.
+  BigNum payoff_;
+};
+
+struct ProofMachineStats {
+  uint64_t num_proofs = 0;         // Patterns proven from scratch.
+  uint64_t num_nested_proofs = 0;  // Proven patterns that apply others.
+  uint64_t num_driver_proofs = 0;  // Proven patterns with a driver span.
+  // Proof attempts whose round spanned several instances of their key.
+  uint64_t num_long_period_attempts = 0;
+  uint64_t num_cache_hits = 0;     // Cached patterns applied.
+  uint64_t num_cache_misses = 0;   // Proof attempts not served by the cache.
+  uint64_t num_cache_evictions = 0;
+  BigNum num_cache_hit_iters = 0;  // Macro steps skipped by cached patterns.
+  // Decisions of the ProofScheduler.
+  uint64_t num_skipped_attempts = 0;  // Confirmed patterns not proven.
+  uint64_t num_backing_off = 0;       // Patterns whose last attempt failed.
+  uint64_t instance_threshold = ProofScheduler::DEFAULT_THRESHOLD;
+  uint64_t num_history_entries = 0;  // Tape patterns with storage for history.
+  // Recycled history entries whose key storage grew.
+  uint64_t num_regrown_history_keys = 0;
+  uint64_t num_kept_instances = 0;  // Instances recorded in the history.
+  // Distinct micro machine steps cached by the macro machine.
+  uint64_t num_cached_micro_steps = 0;
+
+  friend std::ostream& operator<<(std::ostream& os,
+                                  const ProofMachineStats& stats);
+};
+
+// The history of a tape pattern. Only the most recent few instances are kept,
+// along with a count of all instances seen.
+struct PatternHistory {
+  // The max no. recurrences of the tape pattern in a round of a pattern that
+  // starts at it (i.e., its period), e.g., when span sizes only change
+  // consistently every second time the tape pattern recurs.
+  enum { CAPACITY = 4 };
+  uint64_t num_instances = 0;
+  size_t key_hash;  // The hash of the tape pattern's key.
+  RingBuffer<PatternInstance, CAPACITY> instances;
+};
+
+// Maps tape patterns to their histories. Clearing the map just advances an
+// epoch counter: histories from earlier epochs are reset when their pattern is
+// next looked up, and the storage of those that are not looked up again (their
+// key and instances) is recycled for new patterns. This avoids freeing and
+// reallocating all of the history every time a pattern is proven.
+class PatternHistoryMap {
+ public:
+  explicit PatternHistoryMap(int window_radius)
+      : window_radius_(window_radius),
+        epoch_(0),
+        num_used_slots_(0),
+        recycle_cursor_(0),
+        num_regrown_keys_(0) {}
+
+  // Returns the (current-epoch) history of the tape pattern of mstate,
+  // inserting an empty one if there is none.
+  PatternHistory& operator[](const MacroMachineState& mstate);
+  // Invalidates all histories.
+  void clear() { ++epoch_; }
+  // Returns the number of entries, including those from earlier epochs.
+  size_t size() const { return entries_.size(); }
+  // Returns the number of times an entry's key storage had to grow when it was
+  // recycled for a new pattern.
+  uint64_t num_regrown_keys() const { return num_regrown_keys_; }
+
+ private:
+  struct Entry {
+    Entry(const MacroMachineState& mstate, int window_radius)
+        : key(mstate, window_radius) {}
+    PatternKey key;
+    uint64_t epoch;
+    PatternHistory history;
+  };
+  // Slot values in table_ are entry indices + 1, or one of these.
+  enum : uint32_t { EMPTY_SLOT = 0, ERASED_SLOT = 0xFFFFFFFF };
+  // The max no. entries inspected when looking for one to recycle.
+  enum { MAX_RECYCLE_SCAN = 4 };
+
+  // Returns the index of the entry for mstate's pattern, or -1.
+  int64_t find(const MacroMachineState& mstate, size_t hash) const;
+  void insert_slot(uint32_t entry_idx);
+  void erase_slot(uint32_t entry_idx);
+  void rehash(size_t table_size);
+  void reset(Entry* entry, size_t hash);
+
+  int window_radius_;
+  uint64_t epoch_;
+  // Note: std::deque does not move existing elements when it grows.
+  std::deque<Entry> entries_;
+  // Open-addressing hash table (with linear probing) of entry indices.
+  std::vector<uint32_t> table_;
+  size_t num_used_slots_;  // No. slots that are not EMPTY_SLOT.
+  size_t recycle_cursor_;
+  uint64_t num_regrown_keys_;
+};
+
+// Events at which the history may be recorded (see ProofMachineOptions).
+enum HistoryAnchor : unsigned {
+  ANCHOR_TAPE_END = 1 << 0,     // The head is on the first or last span.
+  ANCHOR_SPAN_CHANGE = 1 << 1,  // The last step created or deleted a span.
+  ANCHOR_STATE = 1 << 2,        // The machine is in the anchor state and
+                                // moving in the anchor direction.
+};
+
+struct ProofMachineOptions {
+  // Max no. proven patterns to cache (0 disables the cache).
+  size_t pattern_cache_capacity = 4096;
+  // If non-zero, patterns are keyed on only the spans within this distance of
+  // the head instead of on the whole tape (see PatternWindow). This allows
+  // proofs to succeed even when distant parts of the tape have changed.
+  int window_radius = 0;
+  // If true, applications of proven patterns are recorded in the history as
+  // single steps, so that patterns made of other patterns can be proven.
+  bool nested_proofs = false;
+  // If false, every confirmed pattern is proven once its tape pattern has
+  // been seen a fixed no. times (see ProofScheduler).
+  bool adaptive_schedule = true;
+  // If non-zero, the history is only recorded (and, without nested proofs,
+  // cached patterns are only looked up) at these HistoryAnchor events, and
+  // the steps between them are plain macro steps. Patterns can then only
+  // start at anchors, but most steps skip constructing and hashing keys.
+  unsigned history_anchors = 0;
+  uint anchor_state = 0;
+  bool anchor_moving_right = true;
+  // If true, tape patterns that recur periodically are detected on a helper
+  // thread (see ProofPipeline), and the history is only recorded at their
+  // predicted recurrences. Which patterns are proven then depends on timing.
+  bool pipelined = false;
+};
+
+class ProofMachine {
  public:
-  ProofMachine(const RuleTable& rule_table, int macro_nbit)
-      : macro_machine_(rule_table, macro_nbit) {}
+  ProofMachine(const RuleTable& rule_table, int macro_nbit,
+               const ProofMachineOptions& options = ProofMachineOptions())
+      : rule_table_(rule_table),
+        macro_nbit_(macro_nbit),
+        macro_machine_(rule_table, macro_nbit),
+        options_(options),
+        history_map_(options.window_radius),
+        proven_patterns_(options.pattern_cache_capacity,
+                         options.window_radius),
+        scheduler_(options.adaptive_schedule),
+        pipeline_(options.pipelined ? new ProofPipeline() : nullptr),
+        watched_keys_(options.pipelined ? ProofPipeline::MAX_NUM_WATCHES : 0,
+                      PatternKey(options.window_radius)),
+        step_pattern_key_(options.window_radius) {}
+  // Forks parent for a rule table that defines rules that were undefined in
+  // parent's, to resume parent's simulation from where it halted on one of
+  // them (see MacroMachineState::resume). The proven patterns and the cached
+  // micro steps that did not halt never reached an undefined rule, so they
+  // carry over, while the history starts again.
+  ProofMachine(const ProofMachine& parent, const RuleTable& rule_table)
+      : rule_table_(rule_table),
+        macro_nbit_(parent.macro_nbit_),
+        macro_machine_(parent.macro_machine_, rule_table),
+        options_(parent.options_),
+        history_map_(options_.window_radius),
+        proven_patterns_(parent.proven_patterns_),
+        scheduler_(parent.scheduler_),
+        pipeline_(options_.pipelined ? new ProofPipeline() : nullptr),
+        watched_keys_(options_.pipelined ? ProofPipeline::MAX_NUM_WATCHES : 0,
+                      PatternKey(options_.window_radius)),
+        stats_(parent.stats_),
+        last_num_spans_(parent.last_num_spans_),
+        step_pattern_key_(options_.window_radius) {}
 
   // Updates the arguments.
   void step(MacroMachineState* mstate, BigNum* num_micro_steps,
             BigNum* macro_pos, BigNum* num_iters) const;
 
+  // Returns the undefined rule that mstate halted on (see
+  // MacroMachine::undefined_rule).
+  int undefined_rule(const MacroMachineState& mstate) const {
+    return macro_machine_.undefined_rule(mstate);
+  }
+
+  const ProofMachineStats& stats() const {
+    stats_.num_history_entries = history_map_.size();
+    stats_.num_regrown_history_keys = history_map_.num_regrown_keys();
+    stats_.num_cached_micro_steps = macro_machine_.num_cached_micro_steps();
+    return stats_;
+  }
+
+  // Writes the cached proven patterns to a compact binary store, or loads
+  // them from one so that they are applied as soon as their tape patterns
+  // appear (subject to the usual applicability checks). A store can only be
+  // loaded by a machine with the same rule table, macro_nbit and window
+  // radius. load_patterns throws std::runtime_error (and loads nothing) if
+  // the store does not match or is malformed, and returns the no. patterns
+  // loaded.
+  void save_patterns(std::ostream& os) const;
+  size_t load_patterns(std::istream& is);
+
  private:
-  // Returns the number of times the pattern was applied (may be 0 if the
-  // pattern was disproved).
-  BigNum step_with_potential_pattern(Pattern* pattern,
-                                     const PatternInstance& current_instance,
-                                     MacroMachineState* mstate,
-                                     BigNum* num_micro_steps, BigNum* macro_pos,
-                                     BigNum* num_iters) const;
+  // Steps through another round of the potential pattern (which must start at
+  // current_instance, whose key is pattern_key) and returns true if it proved
+  // the pattern. If so, the pattern's span size lower bounds and micro step
+  // counts (and its driver, if it has one) are filled in.
+  bool prove_pattern(Pattern* pattern, const PatternKey& pattern_key,
+                     const PatternInstance& current_instance,
+                     MacroMachineState* mstate, BigNum* num_micro_steps,
+                     BigNum* macro_pos, BigNum* num_iters) const;
+
+  // Attempts to prove (and then applies) a pattern that was confirmed by
+  // comparing historic_instance with current_instance_, records the attempt
+  // with the scheduler and clears the history.
+  void attempt_proof(Pattern* pattern, const PatternInstance& historic_instance,
+                     size_t key_hash, bool nohalt, MacroMachineState* mstate,
+                     BigNum* num_micro_steps, BigNum* macro_pos,
+                     BigNum* num_iters) const;
+
+  // Finds and applies a cached pattern, updating the arguments. Returns the
+  // pattern and writes the no. times it was applied to *num_times, or returns
+  // nullptr if there was no applicable pattern.
+  const Pattern* apply_cached_pattern(MacroMachineState* mstate,
+                                      BigNum* num_micro_steps,
+                                      BigNum* macro_pos, BigNum* num_iters,
+                                      BigNum* num_times) const;
+
+  // Takes a single proof step (an application of a cached pattern if nested
+  // proofs are enabled and one applies, otherwise a single macro step), and
+  // advances the history clock.
+  void take_step(MacroMachineState* mstate, BigNum* num_micro_steps,
+                 BigNum* macro_pos, BigNum* num_iters) const;
+
+  // Returns the history of the tape pattern of mstate if the pipeline predicted
+  // that it would recur at this step, otherwise nullptr.
+  PatternHistory* watched_history(const MacroMachineState& mstate) const;
+
+  // Clears the history and resets the history clock (and the round tracker).
+  void clear_history() const;
+
+  // Returns true if the history should be recorded at mstate (this must be
+  // called at every proof step when anchors are enabled).
+  bool at_history_anchor(const MacroMachineState& mstate) const;
+
+  // The state of prove_pattern() (see there): the spans whose sizes depend on
+  // a parameter, and the parameters by window index.
+  struct TrackedSpan {
+    SpanID id;
+    int param;  // The window index of the parameter.
+    BigNum coef;
+  };
+  struct Param {
+    BigNum size0;        // The value of the parameter in this round.
+    BigNum lower_bound;  // The min value for which the round is proven.
+    // The coefficients of the parameter in (twice) the no. micro steps, the
+    // change in macro position and the no. iterations of the round.
+    BigNum num_micro_steps_x2;
+    BigNum num_macro_steps;
+    BigNum num_iters;
+  };
+  // Returns the tracked span with the given ID, or nullptr.
+  TrackedSpan* find_tracked_span(SpanID id) const;
+  // Starts tracking a span, which must not already be tracked.
+  void track_span(SpanID id, int param, const BigNum& coef) const;
+  // Stops tracking a span (if it is tracked).
+  void untrack_span(SpanID id) const;
 
+  RuleTable rule_table_;
+  int macro_nbit_;
   MacroMachine macro_machine_;
-  typedef FastList<PatternInstance> historic_instances_type;
+  ProofMachineOptions options_;
   // **TODO: Consider moving these (along with MacroMachineState) into a
   //           ProofMachineState struct to be passed to step(). This would
   //             treat them as official parts of the machine state, instead of
   //             just caching utilities.
   // Maps tape patterns to their historic instances.
-  mutable std::unordered_map<PatternKey, historic_instances_type> history_map_;
-  mutable std::unordered_map<PatternKey, Pattern> proven_patterns_;
+  mutable PatternHistoryMap history_map_;
+  // Maps tape patterns to proven patterns that start at them.
+  mutable PatternCache proven_patterns_;
+  mutable ProofScheduler scheduler_;
+  // Detects recurring tape patterns on a helper thread (if pipelined).
+  std::unique_ptr<ProofPipeline> pipeline_;
+  // The histories of the tape patterns watched by the pipeline (which are used
+  // instead of history_map_), and their keys, by watch index.
+  mutable PatternHistory watched_histories_[ProofPipeline::MAX_NUM_WATCHES];
+  mutable std::vector<PatternKey> watched_keys_;
+  mutable ProofMachineStats stats_;
+  // The history clock counts proof steps, micro steps, macro position and
+  // iterations since the history was last cleared. Patterns only depend on
+  // differences between these values, and measuring them from this origin
+  // instead of from the start of the simulation keeps them small.
+  mutable uint64_t history_num_steps_ = 0;
+  mutable BigNum history_num_micro_steps_ = 0;
+  mutable BigNum history_macro_pos_ = 0;
+  mutable BigNum history_num_iters_ = 0;
+  // True if the last proof step applied a pattern. The states that result are
+  // not recorded in the history, so that the rounds of a pattern that share
+  // its key with a shallower one start and end before the latter is applied.
+  mutable bool applied_pattern_ = false;
+  // The no. spans at the previous proof step (for ANCHOR_SPAN_CHANGE).
+  mutable int last_num_spans_ = 0;
+  // Tracks the round that follows the first instance to be kept in the
+  // history (until the next proof attempt clears it).
+  mutable RoundTracker round_tracker_;
+  // Scratch space for the instance, candidate pattern and proof step at the
+  // current step, which is reused so that steps do not allocate.
+  mutable PatternInstance current_instance_;
+  mutable Pattern step_pattern_;
+  mutable PatternKey step_pattern_key_;
+  mutable BigNum step_num_micro_steps_;
+  mutable BigNum step_num_macro_steps_;
+  mutable BigNum step_num_iters_;
+  mutable BigNum step_num_times_;
+  mutable BigNum step_old_cur_span_size_;
+  mutable BigNum step_this_num_micro_steps_;
+  mutable Pattern::Scratch step_pattern_scratch_;
+  // The tracked spans and parameters of prove_pattern(), which are only ever
+  // grown, so that their storage is reused from attempt to attempt. The
+  // first num_tracked_spans_ tracked spans are in use.
+  mutable size_t num_tracked_spans_ = 0;
+  mutable std::vector<TrackedSpan> tracked_spans_;
+  mutable std::vector<Param> params_;
 };
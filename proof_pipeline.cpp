@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "proof_pipeline.hpp"
+
+ProofPipeline::ProofPipeline()
+    : stopping_(false),
+      simulation_waiting_(false),
+      helper_waiting_(false),
+      helper_(&ProofPipeline::run_helper, this) {}
+
+ProofPipeline::~ProofPipeline() {
+  stopping_.store(true);
+  wake(helper_waiting_);
+  helper_.join();
+}
+
+template <typename Predicate>
+void ProofPipeline::wait(std::atomic<bool>* waiting, Predicate ready) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // Note: The fences here and in wake() ensure that either this thread sees
+  // the change that makes it ready, or the other thread sees that it is
+  // waiting (and notifies it under the mutex, which it holds until it waits).
+  waiting->store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  cv_.wait(lock, ready);
+  waiting->store(false, std::memory_order_relaxed);
+}
+
+void ProofPipeline::wake(const std::atomic<bool>& waiting) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!waiting.load(std::memory_order_relaxed)) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  cv_.notify_all();
+}
+
+int ProofPipeline::record_step(size_t key_hash, bool* new_key) {
+  pop_signals();
+  uint64_t step_num = step_num_++;
+  // Note: The helper is waited for rather than dropping records, which would
+  // leave gaps in the recurrences that it is looking for. Signals are popped
+  // while waiting, in case the helper is itself waiting to push one.
+  while (!records_.try_push(StepRecord{step_num, key_hash})) {
+    wait(&simulation_waiting_,
+         [this]() { return !records_.full() || !signals_.empty(); });
+    pop_signals();
+  }
+  wake(helper_waiting_);
+  int watch_idx = -1;
+  for (int i = 0; i < MAX_NUM_WATCHES; ++i) {
+    Watch& w = watches_[i];
+    if (!w.active || w.signal.step_num != step_num) continue;
+    if (w.signal.key_hash != key_hash) {
+      // The key did not recur when predicted, so stop watching it.
+      w.active = false;
+      continue;
+    }
+    w.signal.step_num += w.signal.period;
+    watch_idx = i;
+  }
+  if (watch_idx != -1) {
+    *new_key = watches_[watch_idx].new_key;
+    watches_[watch_idx].new_key = false;
+  }
+  return watch_idx;
+}
+
+void ProofPipeline::pop_signals() {
+  Signal signal;
+  bool popped = false;
+  while (signals_.try_pop(&signal)) {
+    watch(signal);
+    popped = true;
+  }
+  if (popped) wake(helper_waiting_);
+}
+
+void ProofPipeline::watch(Signal signal) {
+  ++num_signals_;
+  // The simulation thread has usually moved on since the key last recurred.
+  signal.step_num += signal.period;
+  if (signal.step_num < step_num_) {
+    signal.step_num +=
+        (step_num_ - signal.step_num + signal.period - 1) / signal.period *
+        signal.period;
+  }
+  // Note: Watches stay at the same index while they watch the same key, and
+  // a new key replaces an inactive watch or else the one that is furthest
+  // from its next recurrence.
+  Watch* replaced = nullptr;
+  for (Watch& w : watches_) {
+    if (w.active && w.signal.key_hash == signal.key_hash) {
+      w.signal = signal;
+      return;
+    }
+    if (!replaced || (replaced->active &&
+                      (!w.active || w.signal.step_num >
+                                        replaced->signal.step_num))) {
+      replaced = &w;
+    }
+  }
+  replaced->signal = signal;
+  replaced->active = true;
+  replaced->new_key = true;
+}
+
+void ProofPipeline::run_helper() {
+  StepRecord record;
+  while (true) {
+    if (records_.try_pop(&record)) {
+      wake(simulation_waiting_);
+      detect(record);
+    } else if (stopping_.load()) {
+      return;
+    } else {
+      wait(&helper_waiting_,
+           [this]() { return !records_.empty() || stopping_.load(); });
+    }
+  }
+}
+
+void ProofPipeline::detect(const StepRecord& record) {
+  if (recurrences_.size() >= MAX_NUM_KEYS) recurrences_.clear();
+  Recurrences& recurrences = recurrences_[record.key_hash];
+  recurrences.push_back(record.step_num);
+  for (int stride = 1; stride <= MAX_PERIOD_STRIDE; ++stride) {
+    if (recurrences.size() <= NUM_PERIODS_TO_SIGNAL * stride) break;
+    uint64_t period = record.step_num - recurrences.from_back(stride);
+    bool periodic = true;
+    for (int i = 1; i < NUM_PERIODS_TO_SIGNAL && periodic; ++i) {
+      periodic = recurrences.from_back(i * stride) -
+                     recurrences.from_back((i + 1) * stride) ==
+                 period;
+    }
+    if (!periodic) continue;
+    // Note: Signals are never dropped, as that would make which patterns are
+    // proven depend on how far behind the simulation thread is.
+    Signal signal{record.key_hash, record.step_num, period};
+    while (!signals_.try_push(signal)) {
+      wait(&helper_waiting_,
+           [this]() { return !signals_.full() || stopping_.load(); });
+      if (stopping_.load()) return;
+    }
+    wake(simulation_waiting_);
+    recurrences.clear();
+    return;
+  }
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "ring_buffer.hpp"
+#include "spsc_ring.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+// Offloads the detection of recurring tape patterns from the simulation thread
+// to a helper thread. The simulation thread streams a record of each proof
+// step (the step's no. and its key hash) to the helper, which looks up the
+// key's recent recurrences, finds keys that recur with a fixed period (in
+// proof steps) and signals them back. The simulation thread watches for the
+// next recurrences of the signalled keys, and only records the history at
+// those, keeping each watched key's history by the index of its watch (so it
+// never looks keys up itself). It takes plain macro steps otherwise.
+//
+// Each thread blocks (rather than spinning) while it has to wait for the
+// other: the helper while there are no records, and either thread while the
+// ring it pushes to is full.
+class ProofPipeline {
+ public:
+  enum { MAX_NUM_WATCHES = 8 };
+
+  ProofPipeline();
+  ~ProofPipeline();
+  ProofPipeline(const ProofPipeline&) = delete;
+  ProofPipeline& operator=(const ProofPipeline&) = delete;
+
+  // Simulation thread: Records a proof step at the tape pattern with the given
+  // key hash. If the history should be recorded at it, returns the index (in
+  // [0, MAX_NUM_WATCHES)) of the watch that predicted it, and sets *new_key to
+  // true if the watch has been given a new key since it was last returned (so
+  // that the history kept for it must be reset). Otherwise returns -1.
+  int record_step(size_t key_hash, bool* new_key);
+
+  // Simulation thread: The no. keys that have been signalled so far.
+  uint64_t num_signals() const { return num_signals_; }
+
+ private:
+  // Keys are signalled once they recur this many times in a row with the same
+  // period (or with the same period over every second recurrence, for keys
+  // that recur more than once per round of their pattern).
+  enum { NUM_PERIODS_TO_SIGNAL = 2, MAX_PERIOD_STRIDE = 2 };
+  // The helper forgets the recurrences of all keys when there are this many.
+  enum { MAX_NUM_KEYS = 1 << 16 };
+
+  struct StepRecord {
+    uint64_t step_num;
+    size_t key_hash;
+  };
+  // A key that recurred at step_num and is expected to recur every period
+  // steps from then on.
+  struct Signal {
+    size_t key_hash;
+    uint64_t step_num;
+    uint64_t period;
+  };
+  // A signalled key, with step_num advanced to its next expected recurrence.
+  struct Watch {
+    Signal signal;
+    bool active = false;
+    bool new_key = false;
+  };
+  typedef RingBuffer<uint64_t, NUM_PERIODS_TO_SIGNAL * MAX_PERIOD_STRIDE + 1>
+      Recurrences;
+
+  void run_helper();
+  // Helper thread: Adds a record to the recurrences of its key, and signals
+  // the key if they have become periodic.
+  void detect(const StepRecord& record);
+  // Simulation thread: Pops any signals and watches for the next recurrences
+  // of their keys.
+  void pop_signals();
+  void watch(Signal signal);
+  // Blocks the calling thread, whose flag is *waiting, until ready() is true.
+  template <typename Predicate>
+  void wait(std::atomic<bool>* waiting, Predicate ready);
+  // Wakes the thread whose flag is waiting if it is blocked.
+  void wake(const std::atomic<bool>& waiting);
+
+  SpscRing<StepRecord, 64> records_;
+  SpscRing<Signal, 256> signals_;
+  std::atomic<bool> stopping_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<bool> simulation_waiting_;
+  std::atomic<bool> helper_waiting_;
+  // Simulation thread state.
+  uint64_t step_num_ = 0;
+  uint64_t num_signals_ = 0;
+  Watch watches_[MAX_NUM_WATCHES];
+  // Helper thread state.
+  std::unordered_map<size_t, Recurrences> recurrences_;
+  // Note: This is declared last so that the thread starts after (and is joined
+  // before) the destruction of everything it uses.
+  std::thread helper_;
+};
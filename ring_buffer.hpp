@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <array>
+#include <cassert>
+
+// A fixed-capacity FIFO queue that evicts its oldest element when a new element
+// is pushed while it is full. Elements are never destroyed while the buffer is
+// alive, so the storage they own (e.g., the capacity of std::vector members)
+// can be reused when they are overwritten (see push_back_recycled()).
+template <typename T, int CAPACITY>
+class RingBuffer {
+  static_assert(CAPACITY > 0, "CAPACITY must be positive");
+
+ public:
+  typedef T value_type;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef int size_type;
+
+  RingBuffer() : back_(CAPACITY - 1), size_(0) {}
+
+  static constexpr size_type capacity() { return CAPACITY; }
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  // Note: The next element is pushed into the first slot again, so that a
+  // buffer that rarely holds more than one element keeps reusing the same one.
+  void clear() {
+    back_ = CAPACITY - 1;
+    size_ = 0;
+  }
+
+  // Appends an element to the back of the buffer and returns a reference to
+  // it. The element's previous contents (possibly those of the evicted front
+  // element) are left in place so that the caller can overwrite them in-place.
+  reference push_back_recycled() {
+    back_ = (back_ + 1) % CAPACITY;
+    if (size_ < CAPACITY) ++size_;
+    return items_[back_];
+  }
+  void push_back(const T& value) { push_back_recycled() = value; }
+
+  reference back() {
+    assert(!empty());
+    return items_[back_];
+  }
+  const_reference back() const {
+    assert(!empty());
+    return items_[back_];
+  }
+  // Returns the element that was pushed age pushes before the back element
+  // (i.e., from_back(0) == back()).
+  reference from_back(size_type age) {
+    assert(0 <= age && age < size_);
+    return items_[(back_ - age + CAPACITY) % CAPACITY];
+  }
+  const_reference from_back(size_type age) const {
+    assert(0 <= age && age < size_);
+    return items_[(back_ - age + CAPACITY) % CAPACITY];
+  }
+
+ private:
+  std::array<T, CAPACITY> items_;
+  size_type back_;
+  size_type size_;
+};
@@ -32,7 +32,7 @@
 
 RuleTable::RuleTable(const std::string& table)
     // Initialized such that all states are STATE_NOHALT for use in printing.
-    : table0_(0xFFFFFFFFu), table1_(0xFFFFFFFFu) {
+    : table0_(0xFFFFFFFFu), table1_(0xFFFFFFFFu), undefined_(0) {
   std::stringstream ss(table);
   std::string buf;
   int i = 0;
@@ -40,6 +40,14 @@ RuleTable::RuleTable(const std::string& table)
     if (i / 2 >= 6) {
       throw std::runtime_error("Rule table exceeds limit of 6 states.");
     }
+    bool symbol = i % 2;
+    uint32_t state = i / 2;
+    ++i;
+    if (buf == "---") {
+      set_rule(symbol, state, Rule{STATE_HALT, 1, 1});
+      undefined_ |= 1u << (2 * state + symbol);
+      continue;
+    }
     if (buf.size() != 3) {
       throw std::runtime_error("Invalid rule string: \"" + buf +
                                "\". Expected 3 characters.");
@@ -61,9 +69,6 @@ RuleTable::RuleTable(const std::string& table)
             std::string("Invalid character in rule string: \"") + c + "\"");
       }
     }
-    bool symbol = i % 2;
-    uint32_t state = i / 2;
-    ++i;
     set_rule(symbol, state, rule);
   }
 }
@@ -72,6 +77,10 @@ std::ostream& operator<<(std::ostream& os, const RuleTable& rule_table) {
   // This relies on initializing the table to STATE_NOHALT.
   for (int st = 0; st < 6 && rule_table(0, st).state != STATE_NOHALT; ++st) {
     for (int sym = 0; sym < 2; ++sym) {
+      if (rule_table.is_undefined(sym, st)) {
+        os << "--- ";
+        continue;
+      }
       Rule rule = rule_table(sym, st);
       char state_char = rule.state == STATE_HALT ? 'H' : 'A' + rule.state;
       os << state_char << rule.symbol << (rule.move_right ? 'R' : 'L') << " ";
@@ -62,6 +62,10 @@ inline static char state_char(uint32_t state) {
 
 // A table of num_symbols(2) * num_states(<=6) rules that define a Turing
 // machine program.
+//
+// Rules may also be left undefined (as when enumerating machines in tree
+// normal form). An undefined rule acts as the halting rule "H1R" wherever the
+// table is run, so a machine halts on the first undefined rule that it reaches.
 class __attribute__((aligned(8))) RuleTable {
  public:
   typedef uint32_t type;
@@ -70,11 +74,13 @@ class __attribute__((aligned(8))) RuleTable {
  private:
   table_type table0_;
   table_type table1_;
+  uint16_t undefined_;  // Bit 2 * state + symbol is set for undefined rules.
 
  public:
   // Construct a rule table by parsing a string representation.
   // table: List of transitions A0 A1 ... E0 E1 separated by whitespace,
   //        where each transition contains the characters 0/1 L/R A/B/C/...
+  //        or is "---" if undefined.
   //        E.g., "1RB 1LC 1RC 1RB 1RD 0LE 1LA 1LD 1RH 0LA".
   explicit RuleTable(const std::string& table = "H1R");
 
@@ -88,9 +94,22 @@ class __attribute__((aligned(8))) RuleTable {
     return detail::bit_cast<Rule>(static_cast<type>(table[state]));
   }
 
+  bool is_undefined(bool symbol, int state) const {
+    return (undefined_ >> (2 * state + symbol)) & 1;
+  }
+  int num_undefined() const { return __builtin_popcount(undefined_); }
+
+  // Defines a rule (which may have been undefined).
+  void define(bool symbol, int state, Rule rule) {
+    undefined_ &= ~(1u << (2 * state + symbol));
+    set_rule(symbol, state, rule);
+  }
+
  private:
   void set_rule(bool symbol, int state, Rule rule) {
     table_type& table = symbol ? table1_ : table0_;
-    table[state] = detail::bit_cast<type>(rule);
+    // The bits of rule beyond its bit-fields are indeterminate, and must not
+    // spill into the neighbouring rules.
+    table[state] = detail::bit_cast<type>(rule) & ((1u << Rule::NBIT) - 1);
   }
 };
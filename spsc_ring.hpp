@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+// A fixed-capacity lock-free FIFO queue for passing elements from one thread
+// (the producer) to another (the consumer). Each method may only be called by
+// the thread noted beside it.
+template <typename T, size_t CAPACITY>
+class SpscRing {
+  static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0,
+                "CAPACITY must be a power of 2");
+
+ public:
+  typedef T value_type;
+
+  SpscRing() : head_(0), tail_(0) {}
+
+  static constexpr size_t capacity() { return CAPACITY; }
+
+  // Producer: Appends value and returns true, or returns false if full.
+  bool try_push(const T& value) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == CAPACITY) return false;
+    items_[tail % CAPACITY] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Producer: Returns true if there is no room to push.
+  bool full() const {
+    return tail_.load(std::memory_order_relaxed) -
+               head_.load(std::memory_order_acquire) ==
+           CAPACITY;
+  }
+
+  // Consumer: Returns true if there is nothing to pop.
+  bool empty() const {
+    return head_.load(std::memory_order_relaxed) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  // Consumer: Removes the front element into *value and returns true, or
+  // returns false if empty.
+  bool try_pop(T* value) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    *value = items_[head % CAPACITY];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  // Note: The items separate the indices, which are written by different
+  // threads, to keep them on different cache lines.
+  std::atomic<size_t> head_;  // Written by the consumer.
+  std::array<T, CAPACITY> items_;
+  std::atomic<size_t> tail_;  // Written by the producer.
+};
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "static_analyzer.hpp"
+
+StaticAnalysis analyze_rule_table(const RuleTable& rule_table) {
+  StaticAnalysis analysis = {STATE_INCOMPLETE, 0, 0, 0, 0, nullptr};
+  // Follow the machine on its blank tape until it first writes a 1. Until
+  // then it only ever reads 0s, so at most one step can be taken per state
+  // before it loops.
+  uint32_t state = 0;
+  uint32_t visited_states = 0;
+  for (;;) {
+    analysis.reachable_states |= 1u << state;
+    analysis.reachable_transitions |= 1u << (2 * state);
+    visited_states |= 1u << state;
+    Rule rule = rule_table(0, state);
+    ++analysis.num_steps;
+    if (rule.state >= STATE_HALT) {
+      analysis.state = STATE_HALT;
+      analysis.num_ones = rule.symbol;
+      analysis.reason = "halts before writing a 1";
+      return analysis;
+    }
+    state = rule.state;
+    if (rule.symbol) break;
+    if (visited_states & (1u << state)) {
+      analysis.state = STATE_NOHALT;
+      analysis.num_steps = 0;
+      analysis.reason = "never writes a 1";
+      analysis.reachable_states |= 1u << state;
+      return analysis;
+    }
+  }
+  analysis.num_steps = 0;
+  // Once a 1 has been written, any state that can be entered may read either
+  // symbol.
+  uint32_t frontier = 1u << state;
+  uint32_t entered_states = frontier;
+  while (frontier) {
+    uint32_t next = 0;
+    for (uint32_t s = 0; s < STATE_HALT; ++s) {
+      if (!(frontier & (1u << s))) continue;
+      analysis.reachable_transitions |= 3u << (2 * s);
+      for (int symbol = 0; symbol < 2; ++symbol) {
+        uint32_t next_state = rule_table(symbol, s).state;
+        if (next_state < STATE_HALT) next |= 1u << next_state;
+      }
+    }
+    frontier = next & ~entered_states;
+    entered_states |= next;
+  }
+  analysis.reachable_states |= entered_states;
+  bool can_halt = false;
+  for (uint32_t s = 0; s < STATE_HALT; ++s) {
+    for (int symbol = 0; symbol < 2; ++symbol) {
+      can_halt |= analysis.can_take(s, symbol) &&
+                  rule_table(symbol, s).state >= STATE_HALT;
+    }
+  }
+  if (!can_halt) {
+    analysis.state = STATE_NOHALT;
+    analysis.reason = "no halting transition is reachable";
+  }
+  return analysis;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "rule_table.hpp"
+
+#include <cstdint>
+
+// What can be determined about a machine from its rule table alone.
+struct StaticAnalysis {
+  // STATE_HALT or STATE_NOHALT if the machine was decided, otherwise
+  // STATE_INCOMPLETE.
+  uint32_t state;
+  // If state == STATE_HALT, the machine's exact results.
+  uint64_t num_ones;
+  uint64_t num_steps;
+  // A bit mask of the states that the machine can ever be in (including
+  // during its last step).
+  uint32_t reachable_states;
+  // A bit mask of the transitions that the machine can ever take, where bit
+  // 2 * state + symbol means reading symbol in state. Transitions that are not
+  // in the mask can never be taken.
+  uint32_t reachable_transitions;
+  // Why the machine was decided (nullptr if it was not).
+  const char* reason;
+
+  bool can_take(uint32_t state, int symbol) const {
+    return (reachable_transitions >> (2 * state + symbol)) & 1;
+  }
+};
+
+// Analyzes a rule table without simulating it beyond the steps it takes before
+// first writing a 1 (which, on a blank tape, can only be a chain of at most one
+// transition per state).
+//
+// Decides machines that never write a 1 (which either halt within that chain
+// or loop through states on a blank tape forever) and machines that can never
+// take a halting transition. Transitions are found to be unreachable if their
+// state is unreachable in the state graph, or if they read a 1 in a state that
+// can only be entered before the first 1 is written.
+StaticAnalysis analyze_rule_table(const RuleTable& rule_table);
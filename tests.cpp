@@ -28,10 +28,26 @@
 
 #include "tests.hpp"
 
+#include "alloc_counter.hpp"
+#include "backward_decider.hpp"
+#include "batch_runner.hpp"
 #include "builtin_rule_tables.hpp"
+#include "cycler_decider.hpp"
+#include "decider_pipeline.hpp"
+#include "far_decider.hpp"
+#include "flat_machine.hpp"
+#include "static_analyzer.hpp"
+#include "tnf_enumerator.hpp"
 #include "turing_machine.hpp"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+std::atomic<uint64_t>* g_num_allocs = nullptr;
 
 namespace {
 
@@ -42,14 +58,18 @@ using std::endl;
 template <typename BN1, typename BN2>
 bool test_case(RuleTable rule_table, int macro_nbit,
                const BN1& expected_num_ones, const BN2& expected_num_steps,
-               uint32_t expected_state) {
+               uint32_t expected_state,
+               const ProofMachineOptions& proof_options =
+                   ProofMachineOptions()) {
   cerr << "====================================================" << endl;
   cerr << "Testing the following rule table with macro_nbit=" << macro_nbit
        << ":" << endl;
   cerr << rule_table << endl;
   cerr << "====================================================" << endl;
   bool passed = true;
-  TMResult result = run_turing_machine(rule_table, macro_nbit);
+  TMOptions options;
+  options.proof_options = proof_options;
+  TMResult result = run_turing_machine(rule_table, macro_nbit, options);
   if (result.num_ones != expected_num_ones) {
     passed = false;
     cerr << "Expected " << expected_num_ones << " ones on tape, got "
@@ -73,6 +93,534 @@ bool test_case(RuleTable rule_table, int macro_nbit,
   return passed;
 }
 
+// Prints a banner with the title and the rule table, runs check (which prints
+// any mismatches to cerr and returns whether the test passed), and prints the
+// verdict.
+template <typename Check>
+bool run_rule_table_test(const std::string& title, const RuleTable& rule_table,
+                         Check check) {
+  cerr << "====================================================" << endl;
+  cerr << title << endl;
+  cerr << rule_table << endl;
+  cerr << "====================================================" << endl;
+  bool passed = check();
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Checks the results of the flat simulator, and that run_turing_machine gives
+// the same results whether or not it hands off to the proof machine.
+bool test_flat_machine(RuleTable rule_table, uint64_t expected_num_ones,
+                       uint64_t expected_num_steps) {
+  return run_rule_table_test(
+      "Testing the flat simulator on the following rule table:", rule_table,
+      [&] {
+        bool passed = true;
+        FlatMachine flat_machine(rule_table);
+        if (!flat_machine.run(expected_num_steps) ||
+            flat_machine.num_ones() != expected_num_ones ||
+            flat_machine.num_steps() != expected_num_steps ||
+            flat_machine.state() != STATE_HALT) {
+          passed = false;
+          cerr << "Expected " << expected_num_ones << " ones in "
+               << expected_num_steps << " steps, got "
+               << flat_machine.num_ones() << " ones in "
+               << flat_machine.num_steps() << " steps in state "
+               << flat_machine.state() << endl;
+        }
+        for (uint64_t budget : {expected_num_steps - 1, expected_num_steps}) {
+          DeciderPipeline pipeline("flat:" + std::to_string(budget) + ",proof",
+                                   3);
+          TMResult result = pipeline.run(rule_table);
+          if (result.num_ones != expected_num_ones ||
+              result.num_steps != expected_num_steps ||
+              result.state != STATE_HALT) {
+            passed = false;
+            cerr << "Expected the same results with a flat step budget of "
+                 << budget << endl;
+          }
+        }
+        return passed;
+      });
+}
+
+bool test_cycler(RuleTable rule_table, bool translated,
+                 uint32_t expected_state, uint64_t expected_num_steps,
+                 uint64_t expected_cycle_length = 0,
+                 int64_t expected_shift = 0) {
+  return run_rule_table_test(
+      std::string("Testing the ") + (translated ? "translated " : "") +
+          "cycler decider on the following rule table:",
+      rule_table, [&] {
+        CyclerResult result =
+            translated ? decide_translated_cycler(rule_table, 100000)
+                       : decide_cycler(rule_table, 100000, 1024);
+        bool passed = result.state == expected_state &&
+                      result.num_steps == expected_num_steps &&
+                      result.cycle_length == expected_cycle_length &&
+                      result.shift == expected_shift;
+        if (!passed) {
+          cerr << "Expected state " << state_char(expected_state) << " after "
+               << expected_num_steps << " steps with cycle length "
+               << expected_cycle_length << " and shift " << expected_shift
+               << ", got state " << state_char(result.state) << " after "
+               << result.num_steps << " steps with cycle length "
+               << result.cycle_length << " and shift " << result.shift << endl;
+        }
+        return passed;
+      });
+}
+
+bool test_backward(RuleTable rule_table, uint32_t expected_state,
+                   int expected_depth) {
+  return run_rule_table_test(
+      "Testing backward reasoning on the following rule table:", rule_table,
+      [&] {
+        BackwardResult result = decide_backward(rule_table, 30);
+        bool passed =
+            result.state == expected_state && result.depth == expected_depth;
+        if (!passed) {
+          cerr << "Expected state " << state_char(expected_state)
+               << " at depth " << expected_depth << ", got state "
+               << state_char(result.state) << " at depth " << result.depth
+               << endl;
+        }
+        return passed;
+      });
+}
+
+bool test_far(RuleTable rule_table, uint32_t expected_state,
+              int expected_dfa_size = 0, bool expected_mirrored = false) {
+  return run_rule_table_test(
+      "Testing finite automata reduction on the following rule table:",
+      rule_table, [&] {
+        FarResult result = decide_far(rule_table, 4, 10);
+        bool passed = result.state == expected_state &&
+                      result.dfa_size == expected_dfa_size &&
+                      result.mirrored == expected_mirrored;
+        if (!passed) {
+          cerr << "Expected state " << state_char(expected_state) << " with a "
+               << expected_dfa_size << "-state DFA (mirrored="
+               << expected_mirrored << "), got state "
+               << state_char(result.state) << " with a " << result.dfa_size
+               << "-state DFA (mirrored=" << result.mirrored << ")" << endl;
+        }
+        return passed;
+      });
+}
+
+bool test_static_analysis(RuleTable rule_table, uint32_t expected_state,
+                          uint32_t expected_reachable_transitions,
+                          uint64_t expected_num_ones = 0,
+                          uint64_t expected_num_steps = 0) {
+  return run_rule_table_test(
+      "Testing static analysis of the following rule table:", rule_table,
+      [&] {
+        StaticAnalysis analysis = analyze_rule_table(rule_table);
+        bool passed =
+            analysis.state == expected_state &&
+            analysis.reachable_transitions == expected_reachable_transitions &&
+            analysis.num_ones == expected_num_ones &&
+            analysis.num_steps == expected_num_steps;
+        if (!passed) {
+          cerr << "Expected state " << state_char(expected_state)
+               << ", reachable transitions " << expected_reachable_transitions
+               << ", " << expected_num_ones << " ones in "
+               << expected_num_steps << " steps, got state "
+               << state_char(analysis.state) << ", reachable transitions "
+               << analysis.reachable_transitions << ", " << analysis.num_ones
+               << " ones in " << analysis.num_steps << " steps" << endl;
+        }
+        return passed;
+      });
+}
+
+// Checks that each machine is decided by the expected stage of a pipeline.
+bool test_pipeline() {
+  cerr << "====================================================" << endl;
+  cerr << "Testing a decider pipeline" << endl;
+  cerr << "====================================================" << endl;
+  DeciderPipeline pipeline("flat:1000,cycler:1000,backward,far", 3);
+  bool passed = true;
+  passed &= pipeline.run(best4).state == STATE_HALT;
+  passed &= pipeline.run(RuleTable("B0R H1R  A0L H1R")).state == STATE_NOHALT;
+  passed &= pipeline.run(RuleTable("C0R D1L  D1R H1R  B0R C0L  D1R C0L"))
+                .state == STATE_NOHALT;
+  passed &= pipeline.run(mabu90_3).state == STATE_NOHALT;
+  // No stage can decide this one within its budget.
+  passed &= pipeline.run(best5).state == STATE_INCOMPLETE;
+  // The no. runs, halted and nonhalting machines for each stage.
+  const uint64_t expected[4][3] = {{5, 1, 0}, {4, 0, 1}, {3, 0, 1}, {2, 0, 1}};
+  for (int i = 0; i < 4; ++i) {
+    const DeciderPipeline::StageStats& stats = pipeline.stats()[i];
+    if (stats.num_runs != expected[i][0] ||
+        stats.num_halted != expected[i][1] ||
+        stats.num_nonhalting != expected[i][2]) {
+      passed = false;
+      cerr << "Unexpected stats for stage " << stats.name << endl;
+    }
+  }
+  pipeline.print_stats(cerr);
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Checks that a batch run on several threads writes the expected results in
+// input order, and that the proof stage stops at its step budget.
+bool test_batch_runner() {
+  cerr << "====================================================" << endl;
+  cerr << "Testing a batch run" << endl;
+  cerr << "====================================================" << endl;
+  TMOptions options;
+  options.max_num_steps = 100000;
+  BatchRunner batch_runner("static,flat:1000,proof", 3, options, 3);
+  std::stringstream in;
+  in << "# Comments and blank lines are skipped.\n";
+  in << "B1R B1L  A1L H1R\n\n";
+  in << "B0R H1R  A0L H1R\n";
+  in << "B1R Q1L\n";
+  in << "B1R C1L  C1R B1R  D1R E0L  A1L D1L  H1R A0L\n";
+  in << "B1L C1R  D1L B0L  A1R C0R  D1R A0R\n";
+  std::stringstream out;
+  bool passed = batch_runner.run(in, out) == 5;
+  const char* const expected[] = {
+      "{\"index\": 0, \"machine\": \"B1R B1L  A1L H1R\", \"result\": "
+      "\"halt\", \"ones\": \"4\", \"steps\": \"6\", \"stage\": \"flat:1000\"",
+      "{\"index\": 1, \"machine\": \"B0R H1R  A0L H1R\", \"result\": "
+      "\"nohalt\", \"ones\": null, \"steps\": \"0\", \"stage\": \"static\"",
+      "{\"index\": 2, \"machine\": \"B1R Q1L\", \"result\": \"error\"",
+      "{\"index\": 3, \"machine\": \"B1R C1L  C1R B1R  D1R E0L  A1L D1L  "
+      "H1R A0L\", \"result\": \"incomplete\", \"ones\": null",
+      "{\"index\": 4, \"machine\": \"B1L C1R  D1L B0L  A1R C0R  D1R A0R\", "
+      "\"result\": \"nohalt\", \"ones\": null, \"steps\": \"0\", "
+      "\"stage\": \"static\""};
+  std::string line;
+  for (const char* prefix : expected) {
+    if (!std::getline(out, line) || line.compare(0, strlen(prefix), prefix)) {
+      passed = false;
+      cerr << "Expected a result starting with " << prefix << ", got " << line
+           << endl;
+    }
+  }
+  passed &= !std::getline(out, line);
+  batch_runner.print_stats(cerr);
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Checks the busy beaver found by enumerating the machines with the given no.
+// states in tree normal form (on two threads), and the no. machines found.
+bool test_tnf_enumerator(int num_states, uint64_t expected_num_ones,
+                         uint64_t expected_num_steps,
+                         uint64_t expected_num_halted,
+                         uint64_t expected_num_nonhalting,
+                         const std::string& stages =
+                             DEFAULT_TNF_PIPELINE_STAGES,
+                         uint64_t max_num_steps = 4096) {
+  cerr << "====================================================" << endl;
+  cerr << "Testing tree normal form enumeration of " << num_states
+       << "-state machines with stages " << stages << " after "
+       << max_num_steps << " flat steps" << endl;
+  cerr << "====================================================" << endl;
+  TMOptions options;
+  options.max_seconds = 1;
+  TnfEnumerator enumerator(num_states, stages, 3, options, max_num_steps, 2);
+  TnfResult result = enumerator.run();
+  bool passed = true;
+  passed &= result.max_num_ones == expected_num_ones;
+  passed &= result.max_num_steps == expected_num_steps;
+  passed &= result.num_halted == expected_num_halted;
+  passed &= result.num_nonhalting == expected_num_nonhalting;
+  passed &= result.num_incomplete == 0 && result.num_unexpanded == 0;
+  cerr << result.num_halted << " halting, " << result.num_nonhalting
+       << " nonhalting and " << result.num_incomplete << " undecided machines"
+       << endl;
+  cerr << "Most ones:  " << result.max_num_ones << " ("
+       << result.max_ones_rule_table << ")" << endl;
+  cerr << "Most steps: " << result.max_num_steps << " ("
+       << result.max_steps_rule_table << ")" << endl;
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Checks the closed form used to apply driver spans against the sequence
+// itself, for constant (a == 1) and geometric (a > 1) growth, including over
+// zero rounds.
+bool test_affine_sequence_sums() {
+  cerr << "====================================================" << endl;
+  cerr << "Testing affine sequence sums" << endl;
+  cerr << "====================================================" << endl;
+  bool passed = true;
+  for (int x0 : {0, 1, 5}) {
+    for (int a : {1, 2, 3}) {
+      for (int b : {-1, 0, 4}) {
+        BigNum x = x0;
+        BigNum expected_sum1 = 0;
+        BigNum expected_sum2 = 0;
+        for (int n = 0; n <= 8; ++n) {
+          BigNum sum1, sum2;
+          BigNum x_n = affine_sequence_sums(x0, a, b, n, &sum1, &sum2);
+          if (x_n != x || sum1 != expected_sum1 || sum2 != expected_sum2) {
+            passed = false;
+            cerr << "Expected x_" << n << " = " << x << " (sums "
+                 << expected_sum1 << ", " << expected_sum2
+                 << ") for x0 = " << x0 << ", a = " << a << ", b = " << b
+                 << ", got " << x_n
+                 << " (sums " << sum1 << ", " << sum2 << ")" << endl;
+          }
+          expected_sum1 += x;
+          expected_sum2 += x * x;
+          x = a * x + b;
+        }
+      }
+    }
+  }
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Checks that, once its storage has warmed up, the proof machine does not
+// allocate on its steps (including those that apply cached patterns), except
+// for those that attempt a proof or grow storage: the tape (i.e., insert a span
+// without reusing the size of an erased one), the history (add or recycle an
+// entry for a tape pattern with a longer key) or the micro machine's cache.
+// Steps that keep an instance are also excluded, because it swaps its storage
+// with that of an older instance (possibly of another tape pattern), so that
+// the next kept instance may have to regrow its span sizes or promote its
+// values to BigNums.
+bool test_steady_state_allocs(RuleTable rule_table, int macro_nbit,
+                              uint64_t num_warmup_steps) {
+  cerr << "====================================================" << endl;
+  cerr << "Testing allocations in the steady state with macro_nbit="
+       << macro_nbit << ":" << endl;
+  cerr << rule_table << endl;
+  cerr << "====================================================" << endl;
+  if (!g_num_allocs) {
+    cerr << "Skipped: allocations are only counted by busy_beaver_test" << endl;
+    return true;
+  }
+  ProofMachine proof_machine(rule_table, macro_nbit);
+  MacroMachineState mstate;
+  BigNum num_micro_steps = 0;
+  BigNum macro_pos = 0;
+  BigNum num_iters = 0;
+  uint64_t num_steps = 0;
+  uint64_t num_plain_steps = 0;
+  uint64_t num_allocating_steps = 0;
+  auto num_events = [&]() {
+    const ProofMachineStats& stats = proof_machine.stats();
+    return stats.num_cache_misses + stats.num_history_entries +
+           stats.num_regrown_history_keys + stats.num_kept_instances +
+           stats.num_cached_micro_steps;
+  };
+  // The no. span sizes with storage, which grows when a span is inserted
+  // without reusing the size of an erased one (even if it is erased again
+  // within the same step).
+  auto num_span_sizes = [&]() {
+    return mstate.tape.size() + mstate.spare_sizes.size();
+  };
+  while (mstate.state != STATE_HALT && mstate.state != STATE_NOHALT) {
+    uint64_t old_num_events = num_events();
+    size_t old_num_span_sizes = num_span_sizes();
+    uint64_t old_num_allocs = g_num_allocs->load(std::memory_order_relaxed);
+    proof_machine.step(&mstate, &num_micro_steps, &macro_pos, &num_iters);
+    bool allocated =
+        g_num_allocs->load(std::memory_order_relaxed) != old_num_allocs;
+    bool eventful = num_events() != old_num_events ||
+                    num_span_sizes() != old_num_span_sizes;
+    if (++num_steps <= num_warmup_steps || eventful) continue;
+    ++num_plain_steps;
+    num_allocating_steps += allocated;
+  }
+  cerr << num_allocating_steps << " of " << num_plain_steps
+       << " steady-state steps allocated" << endl;
+  bool passed = num_plain_steps && num_allocating_steps == 0;
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Returns true if mstate is in the same state as flat_machine, with the same
+// tape contents relative to the head. The spans must be small enough to be
+// compared cell by cell. A halted mstate has not written the macro step it
+// halted in, so then only the no. ones are compared.
+bool same_configuration(const MacroMachineState& mstate, int macro_nbit,
+                        const FlatMachine& flat_machine) {
+  if (mstate.state != flat_machine.state()) return false;
+  if (mstate.state == STATE_HALT) {
+    return halted_population(mstate) == flat_machine.num_ones();
+  }
+  if (tape_population(mstate.tape) != flat_machine.num_ones()) return false;
+  // Cells are numbered from the start of the tape, and the head is at the
+  // first or last cell of the current span (depending on its direction).
+  int64_t head = 0;
+  int64_t num_cells = 0;
+  for (auto span = mstate.tape.begin(); span != mstate.tape.end(); ++span) {
+    if (!span->size.fits_slong_p() || span->size > (1 << 20)) return false;
+    int64_t span_num_cells = span->size.get_si() * macro_nbit;
+    if (span == mstate.cur_span) {
+      head = mstate.moving_right ? num_cells : num_cells + span_num_cells - 1;
+    }
+    num_cells += span_num_cells;
+  }
+  int64_t cell = 0;
+  for (const TapeSpan& span : mstate.tape) {
+    for (int64_t i = 0; i < span.size.get_si(); ++i) {
+      for (int bit = 0; bit < macro_nbit; ++bit, ++cell) {
+        int64_t position = flat_machine.head_position() + cell - head;
+        if (flat_machine.symbol_at(position) != int((span.symbol >> bit) & 1)) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Runs a machine with nested proofs, checking that it proves nested patterns
+// (and, if expect_driver, ones with a driver span), and that after each
+// pattern is applied it is in the same configuration after the same no. steps
+// as the flat simulator. Stops after max_num_steps steps if it does not halt.
+bool test_nested_replay(RuleTable rule_table, int macro_nbit, int window_radius,
+                        uint64_t max_num_steps, bool expect_driver) {
+  cerr << "====================================================" << endl;
+  cerr << "Testing nested patterns against the flat simulator with macro_nbit="
+       << macro_nbit << ", window radius " << window_radius << ":" << endl;
+  cerr << rule_table << endl;
+  cerr << "====================================================" << endl;
+  ProofMachineOptions options;
+  options.nested_proofs = true;
+  options.window_radius = window_radius;
+  ProofMachine proof_machine(rule_table, macro_nbit, options);
+  FlatMachine flat_machine(rule_table);
+  MacroMachineState mstate;
+  BigNum num_micro_steps = 0;
+  BigNum macro_pos = 0;
+  BigNum num_iters = 0;
+  bool passed = true;
+  uint64_t num_applications = 0;
+  while (mstate.state != STATE_HALT && mstate.state != STATE_NOHALT) {
+    uint64_t old_num_cache_hits = proof_machine.stats().num_cache_hits;
+    proof_machine.step(&mstate, &num_micro_steps, &macro_pos, &num_iters);
+    if (proof_machine.stats().num_cache_hits == old_num_cache_hits &&
+        mstate.state != STATE_HALT) {
+      continue;
+    }
+    if (num_micro_steps > max_num_steps) break;
+    uint64_t num_steps = num_micro_steps.get_ui();
+    flat_machine.run(num_steps - flat_machine.num_steps());
+    ++num_applications;
+    if (flat_machine.num_steps() != num_steps ||
+        !same_configuration(mstate, macro_nbit, flat_machine)) {
+      passed = false;
+      cerr << "Different configurations after " << num_steps << " steps"
+           << endl;
+      break;
+    }
+  }
+  const ProofMachineStats& stats = proof_machine.stats();
+  cerr << stats << endl;
+  cerr << num_applications << " pattern applications checked" << endl;
+  passed &= num_applications && stats.num_nested_proofs &&
+            (!expect_driver || stats.num_driver_proofs);
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Checks that a machine started with the patterns proven by another gives the
+// same results (while proving fewer patterns itself), and that machines with a
+// different macro_nbit reject them.
+bool test_pattern_store(RuleTable rule_table, int macro_nbit) {
+  cerr << "====================================================" << endl;
+  cerr << "Testing a pattern store with macro_nbit=" << macro_nbit << ":"
+       << endl;
+  cerr << rule_table << endl;
+  cerr << "====================================================" << endl;
+  std::stringstream store;
+  TMResult results[2];
+  uint64_t num_proofs[2];
+  for (int run = 0; run < 2; ++run) {
+    ProofMachine proof_machine(rule_table, macro_nbit);
+    if (run == 1) proof_machine.load_patterns(store);
+    MacroMachineState mstate;
+    BigNum num_micro_steps = 0;
+    BigNum macro_pos = 0;
+    BigNum num_iters = 0;
+    while (mstate.state != STATE_HALT && mstate.state != STATE_NOHALT) {
+      proof_machine.step(&mstate, &num_micro_steps, &macro_pos, &num_iters);
+    }
+    if (run == 0) proof_machine.save_patterns(store);
+    results[run] =
+        TMResult{halted_population(mstate), num_micro_steps, mstate.state};
+    num_proofs[run] = proof_machine.stats().num_proofs;
+  }
+  cerr << num_proofs[0] << " patterns proven, then " << num_proofs[1]
+       << " with the store" << endl;
+  bool passed = results[1].num_ones == results[0].num_ones &&
+                results[1].num_steps == results[0].num_steps &&
+                results[1].state == results[0].state &&
+                num_proofs[1] < num_proofs[0];
+  store.seekg(0);
+  ProofMachine other_proof_machine(rule_table, macro_nbit + 1);
+  try {
+    other_proof_machine.load_patterns(store);
+    cerr << "Expected the store to be rejected" << endl;
+    passed = false;
+  } catch (const std::runtime_error&) {
+  }
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
+// Runs parent, which must halt on an undefined rule, and then resumes child
+// (which defines that rule) from where it halted, with both the proof machine
+// and the flat machine, checking each against a run of child from scratch.
+bool test_resume(RuleTable parent, RuleTable child, int macro_nbit,
+                 uint64_t expected_num_ones, uint64_t expected_num_steps) {
+  cerr << "====================================================" << endl;
+  cerr << "Testing resuming with macro_nbit=" << macro_nbit << " from:" << endl;
+  cerr << parent << endl;
+  cerr << "====================================================" << endl;
+  TMOptions options;
+  options.silent = true;
+  TMSnapshot snapshot;
+  TMResult parent_result =
+      run_turing_machine(parent, macro_nbit, options, nullptr, &snapshot);
+  bool passed = parent_result.state == STATE_HALT;
+  cerr << "Parent halted after " << parent_result.num_steps << " steps"
+       << endl;
+  TMResult result =
+      run_turing_machine(child, macro_nbit, options, &snapshot, nullptr);
+  cerr << "Child: " << result.num_ones << " ones in " << result.num_steps
+       << " steps" << endl;
+  TMResult fresh_result = run_turing_machine(child, macro_nbit, options);
+  passed &= result.state == STATE_HALT &&
+            result.num_ones == expected_num_ones &&
+            result.num_steps == expected_num_steps &&
+            fresh_result.state == STATE_HALT &&
+            fresh_result.num_ones == result.num_ones &&
+            fresh_result.num_steps == result.num_steps;
+  // The parent's snapshot must not have been disturbed by the child.
+  passed &= snapshot.mstate.state == STATE_HALT &&
+            halted_population(snapshot.mstate) == parent_result.num_ones &&
+            snapshot.num_micro_steps == parent_result.num_steps;
+
+  FlatMachine parent_flat(parent);
+  parent_flat.run(expected_num_steps);
+  passed &= parent_flat.undefined_rule() >= 0 &&
+            parent_flat.undefined_rule() == snapshot.undefined_rule &&
+            parent_flat.num_steps() == parent_result.num_steps;
+  FlatMachine child_flat(parent_flat, child);
+  child_flat.run(expected_num_steps);
+  FlatMachine fresh_flat(child);
+  fresh_flat.run(expected_num_steps);
+  passed &= child_flat.state() == STATE_HALT &&
+            child_flat.num_ones() == expected_num_ones &&
+            child_flat.num_steps() == expected_num_steps &&
+            child_flat.same_configuration(fresh_flat);
+  cerr << (passed ? "Test PASSED" : "Test FAILED") << endl;
+  return passed;
+}
+
 }  // namespace
 
 bool test() {
@@ -95,12 +643,141 @@ bool test() {
         ConciseCompareBigNum(612351597, 788910538, 119), STATE_HALT);
   }
   passed &= test_case(mabu90_8, 3, -1, 155, STATE_NOHALT);
+  // These drift off along the tape forever, leaving junk behind them, which
+  // only the translated cycler detector in the proof loop decides.
+  passed &= test_case(RuleTable("B1L C1R  D1L B0L  A1R C0R  D1R A0R"), 1, -1,
+                      155, STATE_NOHALT);
+  passed &= test_case(RuleTable("B1R C1L  D1R B0R  A1L C0L  D1L A0L"), 3, -1,
+                      191, STATE_NOHALT);
   passed &=
       test_case(bb6_8, 4, ConciseCompareBigNum(250010283, 232693664, 881),
                 ConciseCompareBigNum(892930596, 430817336, 1762), STATE_HALT);
   passed &=
       test_case(bb6_9, 4, ConciseCompareBigNum(464098470, 543758576, 1439),
                 ConciseCompareBigNum(258464867, 609889227, 2879), STATE_HALT);
+  // Many of this machine's patterns at macro_nbit=2 span several instances of
+  // their key.
+  passed &=
+      test_case(bb6_8, 2, ConciseCompareBigNum(250010283, 232693664, 881),
+                ConciseCompareBigNum(892930596, 430817336, 1762), STATE_HALT);
+  // Patterns keyed on windows around the head must give identical results.
+  ProofMachineOptions windowed;
+  for (int window_radius : {2, 4}) {
+    windowed.window_radius = window_radius;
+    for (int macro_nbit : {3, 6, 12}) {
+      passed &= test_case(best5, macro_nbit, 4098, 47176870, STATE_HALT,
+                          windowed);
+      passed &= test_case(bb6_1, macro_nbit, 136612, 13122572797LU,
+                          STATE_HALT, windowed);
+    }
+  }
+  windowed.window_radius = 4;
+  passed &=
+      test_case(bb6_9, 4, ConciseCompareBigNum(464098470, 543758576, 1439),
+                ConciseCompareBigNum(258464867, 609889227, 2879), STATE_HALT,
+                windowed);
+  // As must nested proofs.
+  ProofMachineOptions nested;
+  nested.nested_proofs = true;
+  for (int window_radius : {0, 4}) {
+    nested.window_radius = window_radius;
+    passed &= test_case(best5, 3, 4098, 47176870, STATE_HALT, nested);
+    passed &=
+        test_case(bb6_8, 4, ConciseCompareBigNum(250010283, 232693664, 881),
+                  ConciseCompareBigNum(892930596, 430817336, 1762), STATE_HALT,
+                  nested);
+  }
+  // As must always attempting proofs at a fixed instance threshold.
+  ProofMachineOptions fixed_schedule;
+  fixed_schedule.adaptive_schedule = false;
+  passed &= test_case(mabu90_8, 3, -1, 155, STATE_NOHALT, fixed_schedule);
+  passed &=
+      test_case(bb6_9, 4, ConciseCompareBigNum(464098470, 543758576, 1439),
+                ConciseCompareBigNum(258464867, 609889227, 2879), STATE_HALT,
+                fixed_schedule);
+  // As must recording the history only at anchor events.
+  ProofMachineOptions anchored;
+  anchored.history_anchors = ANCHOR_TAPE_END | ANCHOR_SPAN_CHANGE;
+  passed &= test_case(best5, 3, 4098, 47176870, STATE_HALT, anchored);
+  passed &= test_case(mabu90_8, 3, -1, 155, STATE_NOHALT, anchored);
+  passed &=
+      test_case(bb6_9, 4, ConciseCompareBigNum(464098470, 543758576, 1439),
+                ConciseCompareBigNum(258464867, 609889227, 2879), STATE_HALT,
+                anchored);
+  // As must detecting recurring tape patterns on a helper thread.
+  ProofMachineOptions pipelined;
+  pipelined.pipelined = true;
+  passed &= test_case(best5, 3, 4098, 47176870, STATE_HALT, pipelined);
+  passed &= test_case(bb6_1, 3, 136612, 13122572797LU, STATE_HALT, pipelined);
+  passed &=
+      test_case(bb6_8, 4, ConciseCompareBigNum(250010283, 232693664, 881),
+                ConciseCompareBigNum(892930596, 430817336, 1762), STATE_HALT,
+                pipelined);
+  passed &= test_flat_machine(best1, 1, 1);
+  passed &= test_flat_machine(best2, 4, 6);
+  passed &= test_flat_machine(best3, 6, 14);
+  passed &= test_flat_machine(best4, 13, 107);
+  passed &= test_flat_machine(best5, 4098, 47176870);
+  const RuleTable cycler("B0R H1R  A0L H1R");
+  const RuleTable walker("A0R H1R");
+  passed &= test_cycler(cycler, false, STATE_NOHALT, 3, 2);
+  passed &= test_cycler(RuleTable("D1R A1L  C1L C0L  C1L D0R  B0R A0L"), false,
+                        STATE_NOHALT, 27, 12);
+  passed &= test_cycler(RuleTable("B1L B1R  B0R D1L  B1R C0R  C0L D0L"), false,
+                        STATE_NOHALT, 55, 24);
+  passed &= test_cycler(best4, false, STATE_HALT, 107);
+  // The head walks off forever, so the tape outgrows the limit.
+  passed &= test_cycler(walker, false, STATE_INCOMPLETE, 960);
+  passed &= test_cycler(walker, true, STATE_NOHALT, 2, 1, 1);
+  passed &= test_cycler(RuleTable("B1L C1R  D1L B0L  A1R C0R  D1R A0R"), true,
+                        STATE_NOHALT, 155, 12, 2);
+  // The same machine with its directions flipped.
+  passed &= test_cycler(RuleTable("B1R C1L  D1R B0R  A1L C0L  D1L A0L"), true,
+                        STATE_NOHALT, 155, 12, -2);
+  passed &= test_cycler(best4, true, STATE_HALT, 107);
+  passed &= test_cycler(cycler, true, STATE_INCOMPLETE, 100000);
+  passed &= test_backward(RuleTable("C0R D1L  D1R H1R  B0R C0L  D1R C0L"),
+                          STATE_NOHALT, 2);
+  passed &= test_backward(RuleTable("D1L H0L  C0L A1L  A1L B0R  C0R A0R"),
+                          STATE_NOHALT, 8);
+  // Halting machines must never be decided.
+  passed &= test_backward(best1, STATE_INCOMPLETE, 0);
+  passed &= test_backward(best4, STATE_INCOMPLETE, 30);
+  passed &= test_far(mabu90_3, STATE_NOHALT, 3, true);
+  passed &= test_far(mabu90_5, STATE_NOHALT, 2, true);
+  passed &= test_far(mabu90_8, STATE_NOHALT, 1, false);
+  // Halting machines must never be decided.
+  passed &= test_far(best4, STATE_INCOMPLETE);
+  passed &= test_far(best5, STATE_INCOMPLETE);
+  passed &= test_static_analysis(best1, STATE_HALT, 0x1, 1, 1);
+  passed &= test_static_analysis(RuleTable("B0R H1R  A0L H1R"), STATE_NOHALT,
+                                 0x5);
+  passed &= test_static_analysis(RuleTable("B1R B1L  A1L A1R"), STATE_NOHALT,
+                                 0xF);
+  // A1 halts, but A is only ever entered before the first 1 is written.
+  passed &= test_static_analysis(RuleTable("B1R H1R  C0L B1R  B0R C1L"),
+                                 STATE_NOHALT, 0x3D);
+  passed &= test_static_analysis(best4, STATE_INCOMPLETE, 0xFF);
+  passed &= test_pipeline();
+  passed &= test_batch_runner();
+  passed &= test_tnf_enumerator(1, 1, 1, 1, 0);
+  passed &= test_tnf_enumerator(2, 4, 6, 19, 40);
+  passed &= test_tnf_enumerator(3, 6, 21, 1772, 3643);
+  // The halting machines are all decided by the proof stage, so their children
+  // are resumed in it.
+  passed &= test_tnf_enumerator(2, 4, 6, 19, 40, "backward,far,proof", 1);
+  passed &= test_resume(RuleTable("B1R B1L  A1L C0L  H1R ---  D1R A0R"), best4,
+                        2, 13, 107);
+  passed &= test_resume(
+      RuleTable("B1R C1L C1R B1R D1R E0L A1L D1L H1R ---"), best5, 3, 4098,
+      47176870);
+  passed &= test_affine_sequence_sums();
+  passed &= test_nested_replay(
+      RuleTable("B1R ---  C0L C1R  A1R D0R  B1L D1R"), 1, 3, 3000000, true);
+  passed &= test_pattern_store(bb6_1, 3);
+  passed &= test_pattern_store(bb6_9, 4);
+  passed &= test_steady_state_allocs(bb6_8, 4, 50000);
+  passed &= test_steady_state_allocs(bb6_9, 4, 100000);
   return passed;
 }
 
@@ -109,6 +786,13 @@ bool test_long() {
   passed &=
       test_case(bb6_10, 3, ConciseCompareBigNum(318711900, 928090906, 10566),
                 ConciseCompareBigNum(380914784, 483559719, 21132), STATE_HALT);
+  ProofMachineOptions nested;
+  nested.nested_proofs = true;
+  nested.window_radius = 4;
+  passed &=
+      test_case(bb6_10, 3, ConciseCompareBigNum(318711900, 928090906, 10566),
+                ConciseCompareBigNum(380914784, 483559719, 21132), STATE_HALT,
+                nested);
   passed &=
       test_case(best6, 6, ConciseCompareBigNum(351474952, 618690847, 18267),
                 ConciseCompareBigNum(741207853, 260478608, 36534), STATE_HALT);
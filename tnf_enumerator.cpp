@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "tnf_enumerator.hpp"
+
+#include "flat_machine.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+const char* const DEFAULT_TNF_PIPELINE_STAGES =
+    "static,translated,cycler,backward,far,proof";
+
+namespace {
+
+// Machines that a pipeline stage finds to halt after more than this many steps
+// are not simulated again to find their halting rule.
+const uint64_t MAX_RESIMULATED_STEPS = uint64_t(1) << 32;
+
+std::string to_string(const RuleTable& rule_table) {
+  std::stringstream ss;
+  ss << rule_table;
+  return ss.str();
+}
+
+// Replaces best with the given machine if it has a larger value (breaking
+// ties by the machines' strings, so that the result does not depend on the
+// order in which the machines are found).
+void update_best(const BigNum& value, const RuleTable& rule_table,
+                 BigNum* best_value, RuleTable* best_rule_table) {
+  if (value > *best_value ||
+      (value == *best_value &&
+       to_string(rule_table) < to_string(*best_rule_table))) {
+    *best_value = value;
+    *best_rule_table = rule_table;
+  }
+}
+
+void record_halted(const RuleTable& rule_table, const BigNum& num_ones,
+                   const BigNum& num_steps, TnfResult* result) {
+  ++result->num_halted;
+  update_best(num_ones, rule_table, &result->max_num_ones,
+              &result->max_ones_rule_table);
+  update_best(num_steps, rule_table, &result->max_num_steps,
+              &result->max_steps_rule_table);
+}
+
+void merge(const TnfResult& other, TnfResult* result) {
+  result->num_halted += other.num_halted;
+  result->num_nonhalting += other.num_nonhalting;
+  result->num_incomplete += other.num_incomplete;
+  result->num_unexpanded += other.num_unexpanded;
+  update_best(other.max_num_ones, other.max_ones_rule_table,
+              &result->max_num_ones, &result->max_ones_rule_table);
+  update_best(other.max_num_steps, other.max_steps_rule_table,
+              &result->max_num_steps, &result->max_steps_rule_table);
+  result->incomplete.insert(result->incomplete.end(), other.incomplete.begin(),
+                            other.incomplete.end());
+}
+
+}  // end namespace
+
+struct TnfEnumerator::Node {
+  RuleTable rule_table;
+  int num_used_states;  // States are used in order, starting from A.
+  // The parent machine, which halted on the rule that this one defines, and
+  // which this one resumes from: on a FlatMachine if it halted within
+  // max_num_steps_, otherwise in the pipeline's proof stage if that stage
+  // decided it (at most one is not null).
+  std::shared_ptr<const FlatMachine> parent;
+  std::shared_ptr<const TMSnapshot> snapshot;
+};
+
+class TnfEnumerator::Worker {
+ public:
+  explicit Worker(const TnfEnumerator& enumerator)
+      : enumerator_(enumerator),
+        pipeline_(enumerator.stages_, enumerator.macro_nbit_,
+                  enumerator.options_) {}
+
+  // Decides the machine at node, and appends its children (if any) to
+  // children.
+  void visit(const Node& node, std::vector<Node>* children) {
+    const RuleTable& rule_table = node.rule_table;
+    assert(!node.parent || !node.snapshot);
+    FlatMachine machine = node.parent ? FlatMachine(*node.parent, rule_table)
+                                      : FlatMachine(rule_table);
+    uint64_t max_num_steps = enumerator_.max_num_steps_;
+    std::shared_ptr<const TMSnapshot> snapshot;
+    int undefined_rule;
+    // A machine resumed from a snapshot has already run past max_num_steps.
+    if (node.snapshot || !machine.run(max_num_steps - machine.num_steps())) {
+      TMSnapshot tm_snapshot;
+      TMResult tm_result = pipeline_.run(rule_table, nullptr,
+                                         node.snapshot.get(), &tm_snapshot);
+      if (tm_result.state == STATE_NOHALT) {
+        ++result_.num_nonhalting;
+        return;
+      } else if (tm_result.state != STATE_HALT) {
+        ++result_.num_incomplete;
+        result_.incomplete.push_back(to_string(rule_table));
+        return;
+      }
+      record_halted(rule_table, tm_result.num_ones, tm_result.num_steps,
+                    &result_);
+      if (rule_table.num_undefined() == 1) return;
+      if (tm_snapshot.proof_machine) {
+        undefined_rule = tm_snapshot.undefined_rule;
+        snapshot = std::make_shared<const TMSnapshot>(std::move(tm_snapshot));
+      } else if (tm_result.num_steps > MAX_RESIMULATED_STEPS) {
+        ++result_.num_unexpanded;
+        return;
+      } else {
+        // Simulate it again to find the undefined rule that it halted on.
+        machine.run(tm_result.num_steps.get_ui() - machine.num_steps());
+        assert(machine.stopped());
+        undefined_rule = machine.undefined_rule();
+      }
+    } else {
+      record_halted(rule_table, machine.num_ones(), machine.num_steps(),
+                    &result_);
+      if (rule_table.num_undefined() == 1) return;
+      undefined_rule = machine.undefined_rule();
+    }
+    if (undefined_rule < 0) return;
+    bool symbol = undefined_rule % 2;
+    int state = undefined_rule / 2;
+    int num_states = enumerator_.num_states_;
+    bool is_root = rule_table.num_undefined() == 2 * num_states;
+    // The first rule must move to a new state (or the machine would run off
+    // forever in state A), and it moves right to skip mirror images.
+    int min_next_state = is_root ? 1 : 0;
+    int max_next_state = std::min(node.num_used_states, num_states - 1);
+    // Machines that were resimulated past max_num_steps_ may have very large
+    // tapes, so their children are simulated from the start instead.
+    std::shared_ptr<const FlatMachine> parent;
+    if (!snapshot && machine.num_steps() <= max_num_steps) {
+      parent = std::make_shared<const FlatMachine>(std::move(machine));
+    }
+    for (int next_state = min_next_state; next_state <= max_next_state;
+         ++next_state) {
+      for (uint32_t write = 0; write < 2; ++write) {
+        for (uint32_t move_right = is_root; move_right < 2; ++move_right) {
+          Node child{rule_table,
+                     std::max(node.num_used_states, next_state + 1), parent,
+                     snapshot};
+          child.rule_table.define(
+              symbol, state, Rule{(uint32_t)next_state, write, move_right});
+          children->push_back(child);
+        }
+      }
+    }
+  }
+
+  const DeciderPipeline& pipeline() const { return pipeline_; }
+  const TnfResult& result() const { return result_; }
+
+ private:
+  const TnfEnumerator& enumerator_;
+  DeciderPipeline pipeline_;
+  TnfResult result_;
+};
+
+TnfEnumerator::TnfEnumerator(int num_states, const std::string& stages,
+                             int macro_nbit, const TMOptions& options,
+                             uint64_t max_num_steps, int num_threads)
+    : num_states_(num_states),
+      stages_(stages),
+      macro_nbit_(macro_nbit),
+      options_(options),
+      max_num_steps_(max_num_steps),
+      num_threads_(num_threads),
+      stats_(stages, macro_nbit, options) {
+  if (num_states < 1 || num_states > STATE_HALT) {
+    throw std::runtime_error("No. states must be in the range [1, 6]");
+  }
+  options_.silent = true;
+  if (num_threads_ <= 0) {
+    num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+TnfEnumerator::~TnfEnumerator() {}
+
+TnfResult TnfEnumerator::run() {
+  std::string all_undefined;
+  for (int i = 0; i < 2 * num_states_; ++i) all_undefined += "--- ";
+  std::vector<Node> nodes = {
+      Node{RuleTable(all_undefined), 1, nullptr, nullptr}};
+
+  // Expand the top of the tree a level at a time until there are enough
+  // subtrees to keep all the threads busy.
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (int i = 0; i < num_threads_; ++i) {
+    workers.emplace_back(new Worker(*this));
+  }
+  const size_t min_num_subtrees = 16 * num_threads_;
+  while (!nodes.empty() && nodes.size() < min_num_subtrees) {
+    std::vector<Node> children;
+    for (const Node& node : nodes) workers[0]->visit(node, &children);
+    nodes.swap(children);
+  }
+
+  // Each thread takes the next subtree and enumerates it depth-first.
+  std::atomic<size_t> next_subtree(0);
+  auto work = [&](Worker* worker) {
+    std::vector<Node> stack;
+    for (size_t i = next_subtree++; i < nodes.size(); i = next_subtree++) {
+      stack.push_back(nodes[i]);
+      while (!stack.empty()) {
+        Node node = stack.back();
+        stack.pop_back();
+        worker->visit(node, &stack);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < workers.size(); ++i) {
+    threads.emplace_back(work, workers[i].get());
+  }
+  work(workers[0].get());
+  for (std::thread& thread : threads) thread.join();
+
+  TnfResult result;
+  for (const auto& worker : workers) {
+    merge(worker->result(), &result);
+    stats_.merge_stats(worker->pipeline());
+  }
+  std::sort(result.incomplete.begin(), result.incomplete.end());
+  return result;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2019, Ben Barsdell. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * * Neither the name of the copyright holder nor the names of its
+ *   contributors may be used to endorse or promote products derived
+ *   from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS ``AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+ * OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "bignum.hpp"
+#include "decider_pipeline.hpp"
+#include "rule_table.hpp"
+#include "turing_machine.hpp"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct TnfResult {
+  uint64_t num_halted = 0;
+  uint64_t num_nonhalting = 0;
+  uint64_t num_incomplete = 0;
+  // The no. halting machines whose halting rule was not found (because they
+  // halted after too many steps to simulate again), and so whose children
+  // were not enumerated.
+  uint64_t num_unexpanded = 0;
+  // The halting machines with the most ones and the most steps.
+  BigNum max_num_ones = -1;
+  RuleTable max_ones_rule_table;
+  BigNum max_num_steps = -1;
+  RuleTable max_steps_rule_table;
+  // The machines that were not decided, in the order of their strings.
+  std::vector<std::string> incomplete;
+};
+
+// The stages that TnfEnumerator runs by default (the machines have already
+// been run on a FlatMachine, and most of those that are left drift off
+// forever).
+extern const char* const DEFAULT_TNF_PIPELINE_STAGES;
+
+// Enumerates the num_states-state machines in tree normal form: starting from
+// a table with every rule undefined, each machine is run until it reaches an
+// undefined rule (at which point it is a halting machine), and then one child
+// is made for each way of defining that rule. Only one of each set of
+// equivalent machines is made: states are numbered in the order in which they
+// are first used, and the first move is always to the right (the mirror
+// images of machines are not enumerated). A rule is never defined if it is
+// the last undefined one, since such a machine could not halt.
+//
+// Each machine is first run for up to max_num_steps steps on a FlatMachine.
+// Those that have not halted by then are passed to a DeciderPipeline with the
+// given stages, macro_nbit and options (which are made silent), in which the
+// undefined rules act as halting rules. Children resume from where their
+// parent halted: on a FlatMachine, or (skipping the FlatMachine run) in the
+// pipeline's proof stage if that stage decided the parent. Machines that
+// another stage finds to halt are run again on a FlatMachine (if they halt
+// soon enough) to find the rule that they halted on. The top of the tree is
+// expanded on the calling thread, and then the subtrees below it are shared
+// between num_threads threads (0 => one per hardware thread).
+class TnfEnumerator {
+ public:
+  // Throws std::runtime_error if num_states is not in [1, 6] or stages is
+  // invalid (see DeciderPipeline).
+  TnfEnumerator(int num_states, const std::string& stages, int macro_nbit,
+                const TMOptions& options, uint64_t max_num_steps = 4096,
+                int num_threads = 0);
+  ~TnfEnumerator();
+
+  TnfResult run();
+
+  // Prints the stats of each pipeline stage summed over all runs.
+  void print_stats(std::ostream& os) const { stats_.print_stats(os); }
+
+ private:
+  struct Node;
+  class Worker;
+
+  const int num_states_;
+  const std::string stages_;
+  const int macro_nbit_;
+  TMOptions options_;
+  const uint64_t max_num_steps_;
+  int num_threads_;
+  DeciderPipeline stats_;
+};
@@ -28,14 +28,17 @@
 
 #include "turing_machine.hpp"
 
-#include "proof_machine.hpp"
+#include "cycler_decider.hpp"
 
 #include <sys/sysinfo.h>  // For querying available RAM.
 
 #include <bitset>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
 using std::cerr;
@@ -90,6 +93,23 @@ void print_status(int macro_nbit, uint state, const Tape& tape,
   cout << endl;
 }
 
+// Saves the proof machine's patterns, writing to a temporary file first so that
+// an interrupted save does not clobber the previous store.
+void save_patterns(const ProofMachine& proof_machine, const std::string& path) {
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary);
+    proof_machine.save_patterns(file);
+    if (!file) {
+      cerr << "Warning: Failed to write pattern store " << tmp_path << endl;
+      return;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    cerr << "Warning: Failed to rename " << tmp_path << " to " << path << endl;
+  }
+}
+
 class comma_numpunct : public std::numpunct<char> {
  protected:
   virtual char do_thousands_sep() const { return ','; }
@@ -99,74 +119,146 @@ class comma_numpunct : public std::numpunct<char> {
 }  // end namespace
 
 TMResult run_turing_machine(RuleTable rule_table, int macro_nbit,
-                            size_t max_num_spans) {
-  cout << "-----------------------------------------" << endl;
-  cout << "Running Turing machine with macro_nbit=" << macro_nbit << endl;
-  cout << "-----------------------------------------" << endl;
+                            const TMOptions& options, const TMSnapshot* parent,
+                            TMSnapshot* snapshot) {
+  const ProofMachineOptions& proof_options = options.proof_options;
+  const std::string& load_patterns_path = options.load_patterns_path;
+  const std::string& save_patterns_path = options.save_patterns_path;
+  if (!options.silent) {
+    cout << "-----------------------------------------" << endl;
+    cout << "Running Turing machine with macro_nbit=" << macro_nbit;
+    if (proof_options.window_radius) {
+      cout << ", window_radius=" << proof_options.window_radius;
+    }
+    if (proof_options.nested_proofs) cout << ", nested_proofs";
+    if (!proof_options.adaptive_schedule) cout << ", fixed_schedule";
+    if (proof_options.history_anchors) {
+      cout << ", history_anchors=" << proof_options.history_anchors;
+    }
+    if (proof_options.pipelined) cout << ", pipelined";
+    cout << endl;
+    cout << "-----------------------------------------" << endl;
+  }
   static const std::locale c_locale("C");
   static const std::locale comma_locale(std::locale(), new comma_numpunct());
-  ProofMachine proof_machine(rule_table, macro_nbit);
+  auto proof_machine_ptr =
+      parent ? std::make_shared<ProofMachine>(*parent->proof_machine,
+                                              rule_table)
+             : std::make_shared<ProofMachine>(rule_table, macro_nbit,
+                                              proof_options);
+  ProofMachine& proof_machine = *proof_machine_ptr;
+  if (!load_patterns_path.empty()) {
+    std::ifstream file(load_patterns_path, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("Cannot open pattern store " +
+                               load_patterns_path);
+    }
+    size_t num_loaded = proof_machine.load_patterns(file);
+    if (!options.silent) {
+      cout << "Loaded " << num_loaded << " patterns from "
+           << load_patterns_path << endl;
+    }
+  }
+  uint64_t num_saved_proofs = 0;
+  TranslatedCyclerDetector translated_cycler_detector(macro_nbit);
   MacroMachineState mstate;
   BigNum num_micro_steps = 0;
-  BigNum old_num_micro_steps = 0;
-  BigNum avg_num_micro_steps_per_sec = -1;
   BigNum macro_pos = 0;
   // TODO: Need better names for these.
   BigNum num_iters = 0;
+  if (parent) {
+    mstate = parent->mstate;
+    num_micro_steps = parent->num_micro_steps;
+    macro_pos = parent->macro_pos;
+    num_iters = parent->num_iters;
+    mstate.resume(&num_micro_steps);
+  }
+  BigNum old_num_micro_steps = num_micro_steps;
+  BigNum avg_num_micro_steps_per_sec = -1;
   BigNum num_proof_steps = 0;
   auto print_interval = std::chrono::seconds(1);
-  auto last_print_time = std::chrono::steady_clock::now();
+  auto start_time = std::chrono::steady_clock::now();
+  auto last_print_time = start_time;
+
+  auto max_duration = std::chrono::duration<double>(options.max_seconds);
 
   while (mstate.state != STATE_HALT && mstate.state != STATE_NOHALT) {
+    auto now = std::chrono::steady_clock::now();
+    if ((options.max_num_steps != uint64_t(-1) &&
+         num_micro_steps >= options.max_num_steps) ||
+        (size_t)mstate.tape.size() >= options.max_num_spans ||
+        now - start_time >= max_duration) {
+      mstate.state = STATE_INCOMPLETE;
+      break;
+    }
+
+    const ProofMachineStats& stats = proof_machine.stats();
+    uint64_t old_num_pattern_uses =
+        stats.num_cache_hits + stats.num_cache_misses;
     proof_machine.step(&mstate, &num_micro_steps, &macro_pos, &num_iters);
     ++num_proof_steps;
 
-    auto elapsed_time = std::chrono::steady_clock::now() - last_print_time;
+    // Pattern applications and attempts skip over the macro steps that the
+    // translated cycler detector must see.
+    if (stats.num_cache_hits + stats.num_cache_misses != old_num_pattern_uses ||
+        !macro_pos.fits_slong_p()) {
+      translated_cycler_detector.reset();
+    } else if (mstate.state != STATE_HALT && mstate.state != STATE_NOHALT &&
+               translated_cycler_detector.update(mstate, macro_pos.get_si(),
+                                                 num_iters.get_ui())) {
+      mstate.nohalt_reason = "TRANSLATED CYCLE";
+      mstate.state = STATE_NOHALT;
+    }
+
+    auto elapsed_time = now - last_print_time;
     if (  // true || num_proof_steps < num_iters || // HACK TESTING added first
           // condition(s) for debugging
         elapsed_time >= print_interval) {
-      last_print_time = std::chrono::steady_clock::now();
-      // Print large numbers with thousands separators
-      cout.imbue(comma_locale);
-      cout << "Proof steps: " << ConcisePrintBigNum(num_proof_steps) << endl;
-      cout << "Macro steps: " << ConcisePrintBigNum(num_iters) << endl;
-      // std::chrono::duration<double> elapsed_secs = elapsed_time;
-      auto elapsed_us =
-          std::chrono::duration_cast<std::chrono::microseconds>(elapsed_time);
-      BigNum num_micro_steps_per_sec =
-          //(num_micro_steps - old_num_micro_steps) / elapsed_secs.count();
-          (num_micro_steps - old_num_micro_steps) * 1000000 /
-          elapsed_us.count();
-      if (avg_num_micro_steps_per_sec == -1) {
-        avg_num_micro_steps_per_sec = num_micro_steps_per_sec;
-      } else {
-        avg_num_micro_steps_per_sec = avg_num_micro_steps_per_sec * 95 / 100;
-        avg_num_micro_steps_per_sec += num_micro_steps_per_sec * 5 / 100;
+      last_print_time = now;
+      if (!options.silent) {
+        // Print large numbers with thousands separators
+        cout.imbue(comma_locale);
+        cout << "Proof steps: " << ConcisePrintBigNum(num_proof_steps) << endl;
+        cout << "Macro steps: " << ConcisePrintBigNum(num_iters) << endl;
+        // std::chrono::duration<double> elapsed_secs = elapsed_time;
+        auto elapsed_us =
+            std::chrono::duration_cast<std::chrono::microseconds>(elapsed_time);
+        BigNum num_micro_steps_per_sec =
+            //(num_micro_steps - old_num_micro_steps) / elapsed_secs.count();
+            (num_micro_steps - old_num_micro_steps) * 1000000 /
+            elapsed_us.count();
+        if (avg_num_micro_steps_per_sec == -1) {
+          avg_num_micro_steps_per_sec = num_micro_steps_per_sec;
+        } else {
+          avg_num_micro_steps_per_sec = avg_num_micro_steps_per_sec * 95 / 100;
+          avg_num_micro_steps_per_sec += num_micro_steps_per_sec * 5 / 100;
+        }
+        cout << "Micro steps: " << ConcisePrintBigNum(num_micro_steps)
+             << " (avg speed="
+             << ConcisePrintBigNum(avg_num_micro_steps_per_sec) << "/s)"
+             << endl;
+        old_num_micro_steps = num_micro_steps;
+        cout << "Num spans:   " << mstate.tape.size() << endl;
+        BigNum tape_len = tape_num_macro_symbols(mstate.tape) * macro_nbit;
+        cout << "Tape size:   " << ConcisePrintBigNum(tape_len) << endl;
+        BigNum tape_pop = tape_population(mstate.tape);
+        cout << "Num ones:    " << ConcisePrintBigNum(tape_pop) << " ("
+             << (100. * tape_pop / tape_len) << "%)" << endl;
+        BigNum tape_pos = macro_pos * macro_nbit;
+        cout << "Head pos:    " << ConcisePrintBigNum(tape_pos) << " ("
+             << (100. * tape_pos / tape_len) << "%)" << endl;
+        cout << "Patterns:    " << proof_machine.stats() << endl;
+        cout.imbue(c_locale);
+        cout << ConcisePrintBigNum(num_micro_steps) << ": ";
+        print_status(macro_nbit, mstate.state, mstate.tape, mstate.cur_span,
+                     mstate.moving_right);
+        cout << endl;
       }
-      cout << "Micro steps: " << ConcisePrintBigNum(num_micro_steps)
-           << " (avg speed=" << ConcisePrintBigNum(avg_num_micro_steps_per_sec)
-           << "/s)" << endl;
-      old_num_micro_steps = num_micro_steps;
-      cout << "Num spans:   " << mstate.tape.size() << endl;
-      BigNum tape_len = tape_num_macro_symbols(mstate.tape) * macro_nbit;
-      cout << "Tape size:   " << ConcisePrintBigNum(tape_len) << endl;
-      BigNum tape_pop = tape_population(mstate.tape);
-      cout << "Num ones:    " << ConcisePrintBigNum(tape_pop) << " ("
-           << (100. * tape_pop / tape_len) << "%)" << endl;
-      BigNum tape_pos = macro_pos * macro_nbit;
-      cout << "Head pos:    " << ConcisePrintBigNum(tape_pos) << " ("
-           << (100. * tape_pos / tape_len) << "%)" << endl;
-      cout.imbue(c_locale);
-      cout << ConcisePrintBigNum(num_micro_steps) << ": ";
-      print_status(macro_nbit, mstate.state, mstate.tape, mstate.cur_span,
-                   mstate.moving_right);
-      cout << endl;
-      // cout << "PAUSED" << endl;
-      // std::cin.get();
-
-      if ((size_t)mstate.tape.size() >= max_num_spans) {
-        mstate.state = STATE_INCOMPLETE;
-        break;
+
+      if (!save_patterns_path.empty() &&
+          proof_machine.stats().num_proofs != num_saved_proofs) {
+        num_saved_proofs = proof_machine.stats().num_proofs;
+        save_patterns(proof_machine, save_patterns_path);
       }
 
       if (get_free_ram_fraction() < 0.05) {
@@ -178,17 +270,31 @@ TMResult run_turing_machine(RuleTable rule_table, int macro_nbit,
       }
     }
   }
-  cout.imbue(comma_locale);
-  cout << "Proof steps: " << ConcisePrintBigNum(num_proof_steps) << endl;
-  cout << "Macro steps: " << ConcisePrintBigNum(num_iters) << endl;
-  cout << "Micro steps: " << ConcisePrintBigNum(num_micro_steps) << endl;
-  cout << "Num spans:   " << mstate.tape.size() << endl;
-  cout.imbue(c_locale);
-  print_status(macro_nbit, mstate.state, mstate.tape, mstate.cur_span,
-               mstate.moving_right);
+  if (!options.silent) {
+    if (mstate.nohalt_reason) cout << mstate.nohalt_reason << endl;
+    cout.imbue(comma_locale);
+    cout << "Proof steps: " << ConcisePrintBigNum(num_proof_steps) << endl;
+    cout << "Macro steps: " << ConcisePrintBigNum(num_iters) << endl;
+    cout << "Micro steps: " << ConcisePrintBigNum(num_micro_steps) << endl;
+    cout << "Num spans:   " << mstate.tape.size() << endl;
+    cout << "Patterns:    " << proof_machine.stats() << endl;
+    cout.imbue(c_locale);
+  }
+  if (!save_patterns_path.empty()) {
+    save_patterns(proof_machine, save_patterns_path);
+  }
+  if (!options.silent) {
+    print_status(macro_nbit, mstate.state, mstate.tape, mstate.cur_span,
+                 mstate.moving_right);
+  }
   BigNum num_ones = -1;
   if (mstate.state == STATE_HALT) {
-    num_ones = tape_population(mstate.tape);
+    num_ones = halted_population(mstate);
+    if (snapshot) {
+      *snapshot = TMSnapshot{proof_machine_ptr, mstate, num_micro_steps,
+                             macro_pos, num_iters,
+                             proof_machine.undefined_rule(mstate)};
+    }
   }
   return TMResult{num_ones, num_micro_steps, mstate.state};
 }
@@ -29,13 +29,58 @@
 #pragma once
 
 #include "bignum.hpp"
+#include "proof_machine.hpp"
 #include "rule_table.hpp"
 
+#include <limits>
+#include <memory>
+#include <string>
+
 struct TMResult {
   BigNum num_ones;
   BigNum num_steps;
   uint32_t state;
 };
 
+struct TMOptions {
+  ProofMachineOptions proof_options;
+  // The simulation is stopped (as incomplete) once the tape has this many
+  // spans, once this many (micro) steps have been simulated, or once it has
+  // run for this many seconds.
+  size_t max_num_spans = -1;
+  uint64_t max_num_steps = -1;  // -1 => no limit.
+  double max_seconds = std::numeric_limits<double>::infinity();
+  // If true, nothing is printed to stdout (warnings still go to stderr).
+  bool silent = false;
+  // If not empty, proven patterns are first loaded from the pattern store here
+  // (and run_turing_machine throws std::runtime_error if they cannot be).
+  std::string load_patterns_path;
+  // If not empty, proven patterns are saved to a pattern store here whenever
+  // new ones have been proven (at most once per status print) and at the end
+  // (see ProofMachine::save_patterns).
+  std::string save_patterns_path;
+};
+
+// A run of run_turing_machine that halted, from which a machine that defines
+// the undefined rule that it halted on can be resumed.
+struct TMSnapshot {
+  std::shared_ptr<const ProofMachine> proof_machine;
+  MacroMachineState mstate;
+  BigNum num_micro_steps;
+  BigNum macro_pos;
+  BigNum num_iters;
+  // 2 * state + symbol for the undefined rule that it halted on (see
+  // RuleTable), or -1 if it halted on a defined rule.
+  int undefined_rule;
+};
+
+// If parent is not null, the machine is resumed from where parent halted (it
+// must only define rules that were undefined in parent's rule table, one of
+// which is the one that parent halted on, and options must be the ones that
+// parent was run with, without a pattern store). If snapshot is not null and
+// the machine halts, it is set so that the machine's children can be resumed
+// from it.
 TMResult run_turing_machine(RuleTable rule_table, int macro_nbit,
-                            size_t max_num_spans = -1);
+                            const TMOptions& options = TMOptions(),
+                            const TMSnapshot* parent = nullptr,
+                            TMSnapshot* snapshot = nullptr);
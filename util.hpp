@@ -28,6 +28,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <cstring>
 #include <functional>
 
@@ -54,4 +55,14 @@ inline std::size_t hash_combine(std::size_t seed, const T& v, Rest... rest) {
   return hash_combine(seed, rest...);
 }
 
+// Bijective 64-bit mixing function (the splitmix64 finalizer).
+inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
 }  // namespace detail